@@ -0,0 +1,119 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, container benchmarks */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <memory_resource>
+#include "btff.hpp"
+
+#define ROUNDS 5
+#define KEYS 200000
+
+static unsigned long next(unsigned long& seed)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+template<class Map>
+static void map_churn(Map& map)
+{
+	unsigned long seed = 88172645463325252UL;
+	int i;
+	for(i = 0; i < KEYS; i++)
+		map[next(seed) % (KEYS * 2)] = i;
+	for(i = 0; i < KEYS; i++)
+		map.erase(next(seed) % (KEYS * 2));
+	for(i = 0; i < KEYS; i++)
+		map[next(seed) % (KEYS * 2)] = i;
+}
+
+template<class Vector>
+static void vector_grow(Vector& vectors)
+{
+	int i;
+	int j;
+	vectors.resize(1000);
+	for(j = 0; j < 200; j++)
+		for(i = 0; i < 1000; i++)
+			vectors[i].push_back(j);
+}
+
+template<class F>
+static void run(const char* name, F f)
+{
+	double best = 0;
+	int round;
+	for(round = 0; round < ROUNDS; round++)
+	{
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		f();
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		if(!round || ms < best)
+			best = ms;
+	}
+	printf("%-44s %10.2f ms\n", name, best);
+}
+
+int main(int argc, char** argv)
+{
+	std::pmr::memory_resource* system = std::pmr::new_delete_resource();
+	btff::memory_resource heap;
+
+	run("std::map, std::allocator", [] { std::map<unsigned long, int> map; map_churn(map); });
+	run("std::map, btff::allocator", [] {
+		std::map<unsigned long, int, std::less<unsigned long>, btff::allocator<std::pair<const unsigned long, int> > > map;
+		map_churn(map); });
+	run("pmr::map, new_delete_resource", [=] { std::pmr::map<unsigned long, int> map(system); map_churn(map); });
+	run("pmr::map, btff::memory_resource", [&] { std::pmr::map<unsigned long, int> map(&heap); map_churn(map); });
+	run("pmr::map, btff::region_resource", [] { btff::region_resource region; std::pmr::map<unsigned long, int> map(&region); map_churn(map); });
+
+	run("std::unordered_map, std::allocator", [] { std::unordered_map<unsigned long, int> map; map_churn(map); });
+	run("std::unordered_map, btff::allocator", [] {
+		std::unordered_map<unsigned long, int, std::hash<unsigned long>, std::equal_to<unsigned long>, btff::allocator<std::pair<const unsigned long, int> > > map;
+		map_churn(map); });
+	run("pmr::unordered_map, new_delete_resource", [=] { std::pmr::unordered_map<unsigned long, int> map(system); map_churn(map); });
+	run("pmr::unordered_map, btff::memory_resource", [&] { std::pmr::unordered_map<unsigned long, int> map(&heap); map_churn(map); });
+
+	run("std::vector, std::allocator", [] { std::vector<std::vector<int> > vectors; vector_grow(vectors); });
+	run("std::vector, btff::allocator", [] { std::vector<std::vector<int, btff::allocator<int> > > vectors; vector_grow(vectors); });
+	run("pmr::vector, new_delete_resource", [=] { std::pmr::vector<std::pmr::vector<int> > vectors(system); vector_grow(vectors); });
+	run("pmr::vector, btff::memory_resource", [&] { std::pmr::vector<std::pmr::vector<int> > vectors(&heap); vector_grow(vectors); });
+	run("pmr::vector, btff::region_resource", [] { btff::region_resource region; std::pmr::vector<std::pmr::vector<int> > vectors(&region); vector_grow(vectors); });
+	return 0;
+}
@@ -0,0 +1,886 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, checks
+
+   links libbtff.a and goes through the btff_ prefixed api. every block is
+   filled with a pattern of its own and checked before it is freed, so a
+   block handed out twice or overwritten by the tree shows up as a mismatch.
+   run by make check, exits non-zero on the first section that fails. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "btff-internal.h"
+
+#define CHECK(c) do { if(!(c)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #c); failed++; } } while(0)
+
+#define SLOTS 1024
+#define THREADS 8
+
+struct slot
+{
+	unsigned char* ptr;
+	size_t size;
+};
+
+static int failed;
+static __thread unsigned long seed = 88172645463325252UL;
+
+static unsigned long draw(unsigned long n)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed % n;
+}
+
+static void fill(struct slot* slot, unsigned char* ptr, size_t size)
+{
+	slot->ptr = ptr;
+	slot->size = size;
+	if(ptr)
+		memset(ptr, (int)((unsigned long)ptr >> 3), size);
+}
+
+static int intact(struct slot* slot)
+{
+	size_t i;
+	for(i = 0; i < slot->size; i++)
+		if(slot->ptr[i] != (unsigned char)((unsigned long)slot->ptr >> 3))
+			return 0;
+	return 1;
+}
+
+/* an address range nothing is mapped at, for heaps mapped at a fixed base */
+static void* unused(size_t size)
+{
+	void* base;
+	if(MAP_FAILED == (base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)))
+		return NULL;
+	munmap(base, size);
+	return base;
+}
+
+/* bump allocated blocks keep apart, a block past the region size gets a run
+   of its own, and a reset starts over from the first run */
+static void check_region(void)
+{
+	struct btff_region* region = btff_region_create(4096);
+	struct slot slot[SLOTS];
+	size_t size;
+	void* first;
+	int i;
+	CHECK(region);
+	if(!region)
+		return;
+	for(i = 0; i < SLOTS; i++)
+	{
+		size = 1 + draw(63 == (i & 63) ? 10000 : 300);
+		fill(&slot[i], btff_region_alloc(region, size), size);
+		CHECK(slot[i].ptr && !((unsigned long)slot[i].ptr & (ALIGNMENT - 1)));
+	}
+	for(i = 0; i < SLOTS; i++)
+		CHECK(slot[i].ptr && intact(&slot[i]));
+	CHECK(!btff_region_alloc(region, 0));
+	first = slot[0].ptr;
+	btff_region_reset(region);
+	CHECK(btff_region_alloc(region, 100) == first);
+	btff_region_destroy(region);
+}
+
+/* a file heap opened again finds the blocks it was closed with, reached
+   from root->data */
+static void check_file(void)
+{
+	struct btff_heap* heap;
+	struct slot* slot;
+	char path[64];
+	void* base;
+	size_t size;
+	int i;
+	snprintf(path, sizeof(path), "/tmp/btff-check-%d", (int)getpid());
+	if(!(base = unused(16 << 20)))
+		return;
+	heap = btff_heap_open(path, base, 16 << 20);
+	CHECK(heap == base);
+	if(!heap)
+		return;
+	slot = btff_heap_malloc(heap, SLOTS * sizeof(struct slot));
+	for(i = 0; i < SLOTS; i++)
+	{
+		size = 1 + draw(2000);
+		fill(&slot[i], btff_heap_malloc(heap, size), size);
+	}
+	for(i = 0; i < SLOTS; i += 3)
+	{
+		btff_heap_free(heap, slot[i].ptr);
+		fill(&slot[i], NULL, 0);
+	}
+	heap->data = slot;
+	btff_heap_close(heap);
+	heap = btff_heap_open(path, NULL, 0);
+	CHECK(heap == base);
+	if(heap)
+	{
+		slot = heap->data;
+		for(i = 0; i < SLOTS; i += 3)
+		{
+			size = 1 + draw(2000);
+			fill(&slot[i], btff_heap_malloc(heap, size), size);
+		}
+		for(i = 0; i < SLOTS; i++)
+		{
+			CHECK(slot[i].ptr && intact(&slot[i]));
+			btff_heap_free(heap, slot[i].ptr);
+		}
+		btff_heap_free(heap, slot);
+		btff_heap_close(heap);
+	}
+	unlink(path);
+}
+
+/* a process that dies inside an operation leaves the version of a file heap
+   odd. the next open recovers the heap and the blocks it was closed with,
+   or fails with ENOTRECOVERABLE when the tree does not check out. */
+static void file_churn(const char* path)
+{
+	struct btff_heap* heap = btff_heap_open(path, NULL, 0);
+	void* mine[64] = { NULL };
+	int i;
+	if(!heap)
+		_exit(EXIT_FAILURE);
+	for(;;)
+	{
+		i = draw(64);
+		btff_heap_free(heap, mine[i]);
+		mine[i] = btff_heap_malloc(heap, 1 + draw(2000));
+	}
+}
+
+static void check_crash(void)
+{
+	struct btff_heap* heap;
+	struct slot* slot;
+	char path[64];
+	void* base;
+	size_t size;
+	pid_t pid;
+	int n, i;
+	snprintf(path, sizeof(path), "/tmp/btff-check-%d", (int)getpid());
+	if(!(base = unused(16 << 20)))
+		return;
+	heap = btff_heap_open(path, base, 16 << 20);
+	CHECK(heap == base);
+	if(!heap)
+		return;
+	slot = btff_heap_malloc(heap, SLOTS * sizeof(struct slot));
+	for(i = 0; i < SLOTS; i++)
+	{
+		size = 1 + draw(2000);
+		fill(&slot[i], btff_heap_malloc(heap, size), size);
+	}
+	heap->data = slot;
+	heap->version |= 1;
+	btff_heap_close(heap);
+	heap = btff_heap_open(path, NULL, 0);
+	CHECK(heap == base && !(heap->version & 1));
+	for(n = 0; heap && n < 10; n++)
+	{
+		btff_heap_close(heap);
+		if(!(pid = fork()))
+			file_churn(path);
+		usleep(draw(20000));
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		errno = 0;
+		heap = btff_heap_open(path, NULL, 0);
+		CHECK(heap == base || (!heap && ENOTRECOVERABLE == errno));
+		if(!heap)
+			break;
+		slot = heap->data;
+		for(i = 0; i < SLOTS; i++)
+			CHECK(intact(&slot[i]));
+		for(i = 0; i < 100; i++)
+		{
+			void* ptr = btff_heap_malloc(heap, 1 + draw(2000));
+			CHECK(ptr);
+			btff_heap_free(heap, ptr);
+		}
+	}
+	if(heap)
+	{
+		for(i = 0; i < SLOTS; i++)
+			btff_heap_free(heap, slot[i].ptr);
+		btff_heap_free(heap, slot);
+		btff_heap_close(heap);
+	}
+	unlink(path);
+}
+
+/* private heaps grow in reserved ranges of their own, side by side, and a
+   request past the range fails without harm to the heap */
+static void check_heaps(void)
+{
+	struct btff_heap* heap[2];
+	static struct slot slot[2][SLOTS / 4];
+	size_t size;
+	int h, i;
+	for(h = 0; h < 2; h++)
+	{
+		heap[h] = btff_heap_create(1 << 20);
+		CHECK(heap[h]);
+		if(!heap[h])
+			return;
+	}
+	for(i = 0; i < SLOTS / 4; i++)
+		for(h = 0; h < 2; h++)
+		{
+			size = 1 + draw(2000);
+			fill(&slot[h][i], btff_heap_malloc(heap[h], size), size);
+			CHECK(slot[h][i].ptr && (void*)heap[h] < (void*)slot[h][i].ptr && (void*)(slot[h][i].ptr + size) <= (void*)heap[h] + (1 << 20));
+		}
+	CHECK(!btff_heap_malloc(heap[0], 2 << 20));
+	for(i = 0; i < SLOTS / 4; i += 2)
+	{
+		btff_heap_free(heap[0], slot[0][i].ptr);
+		size = 1 + draw(2000);
+		fill(&slot[0][i], btff_heap_malloc(heap[0], size), size);
+	}
+	for(h = 0; h < 2; h++)
+	{
+		for(i = 0; i < SLOTS / 4; i++)
+			CHECK(slot[h][i].ptr && intact(&slot[h][i]));
+		btff_heap_destroy(heap[h]);
+	}
+}
+
+/* the whole pages of a free run go back on demand, once; an age the clock
+   has not reached purges nothing. the decay thread runs beside allocation. */
+static void check_decay(void)
+{
+	struct btff_heap* heap = btff_heap_create(16 << 20);
+	struct slot slot[SLOTS];
+	size_t size;
+	int i, n;
+	CHECK(heap);
+	if(!heap)
+		return;
+	fill(&slot[0], btff_heap_malloc(heap, 1 << 20), 1 << 20);
+	fill(&slot[1], btff_heap_malloc(heap, 64), 64);
+	CHECK(slot[0].ptr && slot[1].ptr);
+	btff_heap_free(heap, slot[0].ptr);
+	CHECK(0 == btff_heap_purge(heap, 1));
+	CHECK((1 << 19) < btff_heap_purge(heap, 0));
+	CHECK(0 == btff_heap_purge(heap, 0));
+	fill(&slot[0], btff_heap_malloc(heap, 1 << 20), 1 << 20);
+	CHECK(slot[0].ptr && intact(&slot[0]) && intact(&slot[1]));
+	btff_heap_destroy(heap);
+	CHECK(EINVAL == btff_purge_start(PURGE_STEPS - 1));
+	CHECK(!btff_purge_start(PURGE_STEPS));
+	CHECK(EINVAL == btff_purge_start(PURGE_STEPS));
+	memset(slot, 0, sizeof(slot));
+	for(n = 0; n < 50000; n++)
+	{
+		i = draw(SLOTS);
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_free(slot[i].ptr);
+		}
+		size = 1 + draw(40000);
+		fill(&slot[i], btff_malloc(size), size);
+		CHECK(slot[i].ptr);
+	}
+	btff_purge_stop();
+	for(i = 0; i < SLOTS; i++)
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_free(slot[i].ptr);
+		}
+}
+
+/* aligned runs cut next to plain ones, the last malloc used to find the
+   index out of step with the tree */
+static void check_sequence(void)
+{
+	void* ptr[11];
+	int i;
+	ptr[0] = btff_malloc(230);
+	ptr[1] = btff_malloc(143);
+	ptr[2] = btff_malloc(188);
+	ptr[3] = btff_calloc(1, 12);
+	CHECK(!btff_posix_memalign(&ptr[4], 2048, 131));
+	ptr[5] = btff_malloc(104);
+	ptr[6] = btff_malloc(2938);
+	CHECK(!btff_posix_memalign(&ptr[7], 64, 17224));
+	ptr[8] = btff_malloc(415);
+	CHECK(!btff_posix_memalign(&ptr[9], 1024, 478));
+	ptr[10] = btff_malloc(26);
+	for(i = 0; i < 11; i++)
+		CHECK(ptr[i]);
+	for(i = 0; i < 11; i++)
+		btff_free(ptr[i]);
+}
+
+static void check_memalign(void)
+{
+	struct slot slot[SLOTS];
+	void* ptr = NULL;
+	int i, n;
+	check_sequence();
+	memset(slot, 0, sizeof(slot));
+	CHECK(EINVAL == btff_posix_memalign(&ptr, 24, 64));
+	CHECK(EINVAL == btff_posix_memalign(&ptr, 4, 64));
+	for(n = 0; n < 200000; n++)
+	{
+		i = draw(SLOTS);
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_free(slot[i].ptr);
+			slot[i].ptr = NULL;
+		}
+		else
+		if(draw(2))
+		{
+			size_t alignment = (size_t)16 << draw(10);
+			size_t size = 1 + draw(20000);
+			CHECK(!btff_posix_memalign(&ptr, alignment, size));
+			CHECK(!((unsigned long)ptr & (alignment - 1)));
+			CHECK(size <= btff_usable_size(ptr));
+			fill(&slot[i], ptr, size);
+		}
+		else
+		{
+			size_t size = 1 + draw(4000);
+			fill(&slot[i], btff_malloc(size), size);
+			CHECK(slot[i].ptr);
+		}
+	}
+	for(i = 0; i < SLOTS; i++)
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_free(slot[i].ptr);
+		}
+}
+
+/* sampled blocks are in the profile while they live and leave it as they
+   are freed, their allocation counts stay */
+static int profile_read(const char* path, long* inuse_count, long* alloc_count, long* rate)
+{
+	long inuse_bytes, alloc_bytes;
+	FILE* file;
+	int n;
+	if(!(file = fopen(path, "r")))
+		return 0;
+	n = fscanf(file, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%ld", inuse_count, &inuse_bytes, alloc_count, &alloc_bytes, rate);
+	fclose(file);
+	return 5 == n;
+}
+
+static void check_profile(void)
+{
+	struct slot slot[SLOTS];
+	long inuse_count, alloc_count, rate;
+	char path[64];
+	int i;
+	snprintf(path, sizeof(path), "/tmp/btff-check-%d.heap", (int)getpid());
+	CHECK(EINVAL == btff_profile_start(0, NULL, 0));
+	CHECK(!btff_profile_start(4096, NULL, 0));
+	for(i = 0; i < SLOTS; i++)
+		fill(&slot[i], btff_malloc(8192), 8192);
+	CHECK(!btff_profile_dump(path));
+	CHECK(profile_read(path, &inuse_count, &alloc_count, &rate));
+	CHECK(SLOTS / 2 < inuse_count && inuse_count <= alloc_count && 4096 == rate);
+	for(i = 0; i < SLOTS; i++)
+	{
+		CHECK(slot[i].ptr && intact(&slot[i]));
+		btff_free(slot[i].ptr);
+	}
+	CHECK(!btff_profile_dump(path));
+	CHECK(profile_read(path, &inuse_count, &alloc_count, &rate));
+	CHECK(0 == inuse_count && SLOTS / 2 < alloc_count);
+	btff_profile_stop();
+	unlink(path);
+}
+
+/* blocks handed between threads are freed into the arena or chunk they came
+   from, whichever thread frees them */
+static struct slot shared[THREADS * SLOTS];
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void* churn(void* arg)
+{
+	struct slot mine;
+	size_t limit = (size_t)arg;
+	int n, i;
+	seed += (unsigned long)&mine;
+	for(n = 0; n < 100000; n++)
+	{
+		size_t size = 1 + draw(limit);
+		fill(&mine, btff_malloc(size), size);
+		if(!mine.ptr)
+		{
+			CHECK(mine.ptr);
+			break;
+		}
+		i = draw(THREADS * SLOTS);
+		pthread_mutex_lock(&shared_mutex);
+		if(shared[i].ptr && !intact(&shared[i]))
+			CHECK(!"block intact");
+		btff_free(shared[i].ptr);
+		shared[i] = mine;
+		pthread_mutex_unlock(&shared_mutex);
+		if(!draw(16))
+		{
+			unsigned char* ptr = btff_malloc(size);
+			CHECK(ptr && size <= btff_usable_size(ptr));
+			if((ptr = btff_realloc(ptr, size * 2)))
+				CHECK(size * 2 <= btff_usable_size(ptr));
+			btff_free(ptr);
+		}
+	}
+	return NULL;
+}
+
+static void threads(size_t limit)
+{
+	pthread_t thread[THREADS];
+	int i;
+	for(i = 0; i < THREADS; i++)
+		CHECK(!pthread_create(&thread[i], NULL, churn, (void*)limit));
+	for(i = 0; i < THREADS; i++)
+		pthread_join(thread[i], NULL);
+	for(i = 0; i < THREADS * SLOTS; i++)
+		if(shared[i].ptr)
+		{
+			CHECK(intact(&shared[i]));
+			btff_free(shared[i].ptr);
+			shared[i].ptr = NULL;
+		}
+}
+
+static void check_arenas(void)
+{
+	threads(8192);
+}
+
+/* a sparse tree rebuilt keeps every block where it was, and rebuilt again
+   takes no more cells */
+static void check_rebuild(void)
+{
+	struct btff_heap* heap = btff_heap_create(64 << 20);
+	static struct slot slot[16 * SLOTS];
+	void* pool;
+	size_t size;
+	int i;
+	CHECK(heap);
+	if(!heap)
+		return;
+	for(i = 0; i < 16 * SLOTS; i++)
+	{
+		size = 300 + draw(3000);
+		fill(&slot[i], btff_heap_malloc(heap, size), size);
+	}
+	for(i = 0; i < 16 * SLOTS; i += 2)
+		btff_heap_free(heap, slot[i].ptr);
+	CHECK(!btff_heap_rebuild(heap, REBUILD_FILL));
+	CHECK(0 < btff_heap_depth(heap));
+	CHECK(!btff_heap_rebuild(heap, REBUILD_FILL));
+	pool = heap->pool;
+	for(i = 0; i < 40; i++)
+		CHECK(!btff_heap_rebuild(heap, REBUILD_FILL));
+	CHECK(pool == heap->pool);
+	for(i = 1; i < 16 * SLOTS; i += 2)
+		CHECK(intact(&slot[i]));
+	for(i = 0; i < 16 * SLOTS; i += 2)
+	{
+		size = 1 + draw(600);
+		fill(&slot[i], btff_heap_malloc(heap, size), size);
+	}
+	for(i = 0; i < 16 * SLOTS; i++)
+	{
+		CHECK(intact(&slot[i]));
+		btff_heap_free(heap, slot[i].ptr);
+	}
+	btff_heap_destroy(heap);
+}
+
+/* the stats page shows up under /dev/shm, counts the ops of the arenas and
+   goes away on stop */
+static void check_stats(void)
+{
+	struct stats* page;
+	unsigned long malloc_count = 0;
+	unsigned long size = 0;
+	char name[64];
+	void* ptr;
+	int fd;
+	int i;
+	CHECK(EINVAL == btff_stats_start(0));
+	CHECK(!btff_stats_start(1));
+	CHECK(EINVAL == btff_stats_start(1));
+	snprintf(name, sizeof(name), "/btff.%d", (int)getpid());
+	fd = shm_open(name, O_RDONLY, 0);
+	CHECK(-1 != fd);
+	if(-1 == fd)
+	{
+		btff_stats_stop();
+		return;
+	}
+	page = mmap(NULL, sizeof(struct stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	CHECK(MAP_FAILED != page);
+	if(MAP_FAILED == page)
+	{
+		btff_stats_stop();
+		return;
+	}
+	CHECK(STATS_MAGIC == page->magic && getpid() == (pid_t)page->pid);
+	for(i = 0; i < 1000; i++)
+		btff_free(btff_malloc(5000));
+	ptr = btff_malloc(5000);
+	for(i = 0, fd = __atomic_load_n(&page->updated, __ATOMIC_ACQUIRE); i < 5000 && __atomic_load_n(&page->updated, __ATOMIC_ACQUIRE) < fd + 2; i++)
+		usleep(1000);
+	CHECK(1 <= page->heaps && page->heaps <= ARENA_SIZE);
+	for(i = 0; i < page->heaps; i++)
+	{
+		malloc_count += page->heap[i].malloc;
+		size += page->heap[i].size;
+		CHECK(page->heap[i].available <= page->heap[i].size);
+	}
+	CHECK(1000 < malloc_count && 5000 <= size && 0 < page->heap[0].depth);
+	btff_free(ptr);
+	btff_stats_stop();
+	munmap(page, sizeof(struct stats));
+	CHECK(-1 == shm_open(name, O_RDONLY, 0) && ENOENT == errno);
+}
+
+/* a low address run large enough against a higher, tighter one: first fit
+   takes the low run, the index the tighter one */
+static void check_policy(void)
+{
+	int policy;
+	for(policy = BTFF_PLACE_INDEX; policy <= BTFF_PLACE_FIRST; policy++)
+	{
+		struct btff_heap* heap = btff_heap_create(1 << 20);
+		void* big, * small, * ptr;
+		CHECK(heap);
+		if(!heap)
+			return;
+		heap->policy = policy;
+		big = btff_heap_malloc(heap, 4096);
+		btff_heap_malloc(heap, 512);
+		small = btff_heap_malloc(heap, 1024);
+		btff_heap_malloc(heap, 512);
+		btff_heap_free(heap, big);
+		btff_heap_free(heap, small);
+		ptr = btff_heap_malloc(heap, 768);
+		CHECK(ptr == (BTFF_PLACE_FIRST == policy ? big : small));
+		btff_heap_destroy(heap);
+	}
+}
+
+/* refused options are counted and the rest still taken. first fit set on
+   every arena keeps blocks intact. */
+static void check_options(void)
+{
+	struct slot slot[SLOTS];
+	size_t size;
+	int i, n;
+	CHECK(0 == btff_options(""));
+	CHECK(4 == btff_options("policy=best,bogus=1,trim=1q,cache"));
+	CHECK(!btff_mallopt(M_BTFF_POLICY, BTFF_PLACE_FIRST + 1));
+	CHECK(!btff_mallopt(M_BTFF_CACHE, -1));
+	CHECK(0 == btff_options("trim=64k,mmap=1m,cache=4,policy=first"));
+	memset(slot, 0, sizeof(slot));
+	for(n = 0; n < 50000; n++)
+	{
+		i = draw(SLOTS);
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_free(slot[i].ptr);
+		}
+		size = 1 + draw(n & 1 ? 2000 : 100000);
+		fill(&slot[i], btff_malloc(size), size);
+		CHECK(slot[i].ptr);
+	}
+	for(i = 0; i < SLOTS; i++)
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_free(slot[i].ptr);
+		}
+	CHECK(0 == btff_options("trim=0,mmap=0,cache=32,policy=index"));
+}
+
+/* small blocks only, through the thread buffers */
+static void check_tlab(void)
+{
+	CHECK(!btff_mallopt(M_BTFF_TLAB, 512));
+	CHECK(btff_mallopt(M_BTFF_TLAB, 4096));
+	threads(QUICK_MAX);
+	btff_heap_purge(NULL, 0);
+	btff_mallopt(M_BTFF_TLAB, 0);
+	threads(QUICK_MAX);
+}
+
+/* without the buffers small blocks go through the thread caches and the
+   transfer cache, a purge hands the batches back */
+static void check_transfer(void)
+{
+	CHECK(!btff_mallopt(M_BTFF_TRANSFER, 1 << 20));
+	CHECK(btff_mallopt(M_BTFF_TRANSFER, 16));
+	threads(QUICK_MAX);
+	btff_heap_purge(NULL, 0);
+	CHECK(btff_mallopt(M_BTFF_TRANSFER, 0));
+	threads(QUICK_MAX);
+	CHECK(btff_mallopt(M_BTFF_TRANSFER, 16));
+}
+
+static void check_mallocx(void)
+{
+	static unsigned char* hole[SLOTS];
+	struct btff_region* region;
+	unsigned char* ptr, * next, * guard;
+	size_t size;
+	int holes;
+	int i;
+	ptr = btff_mallocx(1000, BTFF_ZERO);
+	for(i = 0; ptr && i < 1000; i++)
+		CHECK(!ptr[i]);
+	btff_dallocx(ptr, 0);
+	ptr = btff_mallocx(200, BTFF_ALIGN(4096));
+	CHECK(ptr && !((unsigned long)ptr & 4095));
+	btff_dallocx(ptr, 0);
+	ptr = btff_mallocx(64, BTFF_ARENA(1));
+	CHECK(ptr && 64 <= btff_sallocx(ptr, 0));
+	btff_dallocx(ptr, 0);
+	CHECK(!btff_mallocx(64, BTFF_ARENA(ARENA_SIZE)) && EINVAL == errno);
+	btff_mallopt(M_ARENA_MAX, 2);
+	CHECK(!btff_mallocx(64, BTFF_ARENA(2)) && EINVAL == errno);
+	btff_mallopt(M_ARENA_MAX, 0);
+	/* the block after ptr is freed, ptr grows into it without moving. the
+	   holes the sections before left are filled until two blocks meet. */
+	ptr = btff_mallocx(4000, BTFF_TCACHE_NONE);
+	next = btff_mallocx(4000, BTFF_TCACHE_NONE);
+	for(holes = 0; ptr && next && next != ptr + btff_sallocx(ptr, 0) && holes < SLOTS; holes++)
+	{
+		hole[holes] = ptr;
+		ptr = next;
+		next = btff_mallocx(4000, BTFF_TCACHE_NONE);
+	}
+	guard = btff_mallocx(4000, BTFF_TCACHE_NONE);
+	CHECK(ptr && next && guard && next == ptr + btff_sallocx(ptr, 0));
+	btff_dallocx(next, 0);
+	memset(ptr, 1, 4000);
+	size = btff_xallocx(ptr, 6000, 1000, BTFF_ZERO);
+	CHECK(6000 <= size && btff_sallocx(ptr, 0) == size);
+	for(i = 4000; i < 6000; i++)
+		CHECK(!ptr[i]);
+	CHECK(!btff_rallocx(ptr, 1 << 20, BTFF_INPLACE));
+	CHECK(btff_sallocx(ptr, 0) == size);
+	CHECK(btff_rallocx(ptr, 2000, BTFF_INPLACE) == ptr);
+	ptr = btff_rallocx(ptr, 50000, BTFF_ZERO | BTFF_ALIGN(256));
+	CHECK(ptr && !((unsigned long)ptr & 255));
+	for(i = 0; ptr && i < 50000; i++)
+		CHECK(ptr[i] == (i < 2000));
+	btff_dallocx(ptr, 0);
+	btff_dallocx(guard, 0);
+	while(holes)
+		btff_dallocx(hole[--holes], 0);
+	region = btff_region_create(4096);
+	btff_region_bind(region);
+	ptr = btff_mallocx(100, BTFF_REGION | BTFF_ZERO | BTFF_ALIGN(128));
+	CHECK(ptr && !((unsigned long)ptr & 127) && !ptr[99]);
+	btff_dallocx(ptr, BTFF_REGION);
+	CHECK(!btff_rallocx(ptr, 200, BTFF_REGION));
+	btff_region_bind(NULL);
+	CHECK(!btff_mallocx(100, BTFF_REGION));
+	btff_region_destroy(region);
+}
+
+/* a bounded heap leaves merges and splits pending: blocks stay intact while
+   the fixes are taken a few at a time, and the tree ends up as deep as the
+   same run gives without a bound, give or take a level */
+static int churn_steps(int steps)
+{
+	struct btff_heap* heap = btff_heap_create(64 << 20);
+	static struct slot slot[16 * SLOTS];
+	size_t size;
+	int depth;
+	int n, i;
+	CHECK(heap);
+	if(!heap)
+		return -1;
+	CHECK(0 == btff_heap_steps(heap, steps));
+	for(n = 0; n < 40 * 16 * SLOTS; n++)
+	{
+		i = draw(16 * SLOTS);
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_heap_free(heap, slot[i].ptr);
+			slot[i].ptr = NULL;
+		}
+		if(draw(4))
+		{
+			size = 1 + draw(n & 1 ? 3000 : 300);
+			fill(&slot[i], btff_heap_malloc(heap, size), size);
+			CHECK(slot[i].ptr);
+		}
+	}
+	for(n = 0; n < 64; n++)
+		btff_heap_free(heap, btff_heap_malloc(heap, 16));
+	depth = btff_heap_depth(heap);
+	for(i = 0; i < 16 * SLOTS; i++)
+		if(slot[i].ptr)
+		{
+			CHECK(intact(&slot[i]));
+			btff_heap_free(heap, slot[i].ptr);
+			slot[i].ptr = NULL;
+		}
+	btff_heap_destroy(heap);
+	return depth;
+}
+
+static void check_steps(void)
+{
+	unsigned long start = seed;
+	int bounded;
+	int unbounded;
+	bounded = churn_steps(1);
+	seed = start;
+	unbounded = churn_steps(0);
+	CHECK(0 < unbounded && bounded <= unbounded + 1);
+	seed = start;
+	CHECK(churn_steps(2) <= unbounded + 1);
+}
+
+/* a child dies holding the lock of a shared heap: a sound tree is checked,
+   rebuilt and handed on, a broken one fails every later call */
+static void die_holding(struct btff_heap* heap, int broken)
+{
+	pid_t pid;
+	if(!(pid = fork()))
+	{
+		pthread_mutex_lock(&heap->mutex);
+		if(broken)
+			heap->node = heap->end;
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static void check_recover(void)
+{
+	struct btff_heap* heap;
+	struct slot slot[SLOTS];
+	char name[64];
+	void* base;
+	size_t size;
+	int i;
+	snprintf(name, sizeof(name), "/btff-check-%d", (int)getpid());
+	if(!(base = unused(16 << 20)))
+		return;
+	heap = btff_heap_share(name, base, 16 << 20);
+	CHECK(heap);
+	if(!heap)
+		return;
+	for(i = 0; i < SLOTS; i++)
+	{
+		size = 1 + draw(2000);
+		fill(&slot[i], btff_heap_malloc(heap, size), size);
+	}
+	for(i = 0; i < SLOTS; i += 3)
+		btff_heap_free(heap, slot[i].ptr);
+	die_holding(heap, 0);
+	for(i = 0; i < SLOTS; i += 3)
+	{
+		size = 1 + draw(2000);
+		fill(&slot[i], btff_heap_malloc(heap, size), size);
+	}
+	for(i = 0; i < SLOTS; i++)
+		CHECK(slot[i].ptr && intact(&slot[i]));
+	die_holding(heap, 1);
+	errno = 0;
+	CHECK(!btff_heap_malloc(heap, 100) && ENOTRECOVERABLE == errno);
+	CHECK(!btff_heap_malloc(heap, 100) && ENOTRECOVERABLE == errno);
+	btff_heap_close(heap);
+	shm_unlink(name);
+}
+
+static struct
+{
+	const char* name;
+	void (*check)(void);
+} checks[] = {
+	{ "region", check_region },
+	{ "file", check_file },
+	{ "crash", check_crash },
+	{ "heaps", check_heaps },
+	{ "decay", check_decay },
+	{ "memalign", check_memalign },
+	{ "profile", check_profile },
+	{ "arenas", check_arenas },
+	{ "rebuild", check_rebuild },
+	{ "stats", check_stats },
+	{ "policy", check_policy },
+	{ "options", check_options },
+	{ "tlab", check_tlab },
+	{ "transfer", check_transfer },
+	{ "mallocx", check_mallocx },
+	{ "steps", check_steps },
+	{ "recover", check_recover } };
+
+int main(void)
+{
+	int i;
+	for(i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++)
+	{
+		checks[i].check();
+		printf("%-10s %s\n", checks[i].name, failed ? "FAILED" : "ok");
+		if(failed)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, internals shared by the core, the
+   library and the tools built beside them. not installed. */
+#ifndef __btff_internal_h__
+#define __btff_internal_h__ __btff_internal_h__
+
+#include <pthread.h>
+#include <stdint.h>
+#include "btff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INDEX_SIZE (sizeof(unsigned long) * 8)
+#define QUICK_SIZE 32
+#define QUICK_DEPTH 32
+#define MAGIC 0x62746666UL
+#define RESERVE_SIZE (sizeof(void*) < 8 ? 1UL << 28 : 1UL << 36)
+#define COMMIT_SIZE (1UL << 20)
+#define ARENA_SIZE (sizeof(void*) < 8 ? 1 : 8)
+
+#define PURGE_STEPS 10
+#define PURGE_BATCH 16
+#define REBUILD_FILL 75
+
+enum { PROVIDER_BRK, PROVIDER_MAP, PROVIDER_RESERVE };
+
+/* the stats page, /dev/shm/btff.<pid>: op counters bumped as ops go, the
+   rest copied every interval by the stats thread */
+
+#define STATS_MAGIC 0x62747374UL
+
+struct stats_heap
+{
+	unsigned long malloc;
+	unsigned long free;
+	unsigned long realloc;
+	unsigned long contended;
+	unsigned long size;
+	unsigned long available;
+	unsigned long runs;
+	unsigned long quick;
+	unsigned long purged;
+	int depth;
+};
+
+struct stats
+{
+	unsigned long magic;
+	unsigned long pid;
+	unsigned long interval;
+	unsigned long updated;
+	int heaps;
+	unsigned long tlab;
+	unsigned long transfer;
+	struct stats_heap heap[ARENA_SIZE];
+};
+enum { LEAF = 30, LIST, HEAP, STACK };
+
+struct btff_heap
+{
+	pthread_mutex_t mutex;
+	unsigned long available;
+	void* node;
+	void* list;
+	unsigned long bitmap;
+	void* index[INDEX_SIZE];
+	unsigned long quick_total;
+	int quick_size[QUICK_SIZE];
+	void* quick[QUICK_SIZE];
+	unsigned long epoch;
+	unsigned long purged;
+	int purge_class;
+	void* purge;
+	unsigned long finger;
+	void* radix;
+	unsigned long version;
+	int steps;
+	unsigned long deferred;
+	void* defer[LEAF];
+	struct stats_heap* stats;
+	unsigned long heap_size;
+	unsigned long free_size;
+	unsigned long free_runs;
+	unsigned long trim;
+	unsigned long release;
+	int cache;
+	int policy;
+	unsigned long magic;
+	int shared;
+	int provider;
+	void* data;
+	void* begin;
+	void* end;
+	void* top;
+	void* commit;
+	void* pool;
+};
+
+#define LEVEL(p) ((int)((p) ? (((unsigned long)((struct node*)(p))->level) < LEAF ? ((struct node*)(p))->level : LEAF) : LEAF))
+#define ROOT_OF(stack) ((struct btff_heap*)(stack)[HEAP].node)
+#define ROOT LEVEL(ROOT_OF(stack)->node)
+
+/* the lock holder keeps the version odd while the tree may change under it,
+   lookups that go without the lock retry when it moved */
+#define VERSION_ENTER(root) do { __atomic_store_n(&(root)->version, (root)->version | 1, __ATOMIC_RELAXED); __atomic_thread_fence(__ATOMIC_RELEASE); } while(0)
+#define VERSION_LEAVE(root) do { __atomic_thread_fence(__ATOMIC_RELEASE); __atomic_store_n(&(root)->version, (root)->version + 1, __ATOMIC_RELAXED); } while(0)
+#define STALE ((size_t)-1)
+#define STALE_RETRY 4
+
+struct stack
+{
+    unsigned long available;
+    void* node;
+    int child;
+};
+
+struct btff
+{
+	struct btff_heap* root;
+	void * (*memmove)(void *dst, void *src, int len);
+	int (*brk)(void *addr);
+	void* (*sbrk)(intptr_t increment);
+    void* (*malloc)(struct stack* stack, size_t size);
+    void (*free)(struct stack* stack, void *ptr);
+    void* (*realloc)(struct stack* stack, void *ptr, size_t* old_size, size_t size);
+	void* (*memalign)(struct stack* stack, size_t alignment, size_t size);
+	void (*sanity_check)(void* p, int level, void* address_end);
+	void (*available_check)(void* root, int level);
+	int (*purge)(struct stack* stack, unsigned long age, int batch);
+	void (*free_sized)(struct stack* stack, void *ptr, size_t size);
+	size_t (*usable_size)(struct btff_heap* root, void *ptr, unsigned long version);
+	int (*rebuild)(struct stack* stack, int fill);
+	void (*census)(struct stack* stack, unsigned long* r_size, unsigned long* r_free, unsigned long* r_runs);
+	void (*batch_free)(struct stack* stack, void* list);
+	int (*spill)(struct btff_heap* root, int size_class, void* list, int count);
+	void* (*resize)(struct stack* stack, void *ptr, size_t* old_size, size_t size, int move);
+	int (*recover)(struct stack* stack);
+};
+
+#define NODE_SIZE 7
+#define NODE_MIDDLE (NODE_SIZE / 2)
+
+struct node
+{
+    int level;
+    int size;
+    void* address[NODE_SIZE];
+    unsigned long available[NODE_SIZE];
+};
+
+#define LEAF_SIZE (64 - sizeof(void*) - 3 * sizeof(char))
+#define LEAF_MIDDLE (LEAF_SIZE / 2)
+#define AVAILABLE 0x01
+#define ALIGNMENT BTFF_MIN_ALIGN
+#define QUICK_MAX (QUICK_SIZE * ALIGNMENT)
+
+struct leaf
+{
+    void* address;
+    char size;
+    unsigned char max;
+    unsigned char second;
+    unsigned char available[LEAF_SIZE];
+} __attribute__ ((__packed__));
+
+struct btff_region
+{
+	struct btff_region* next;
+	void* top;
+	void* end;
+	size_t size;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif/*__btff_internal_h__*/
@@ -0,0 +1,131 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, live stats viewer
+
+   maps the stats page a process publishes under BTFF_STATS and redraws it
+   every interval: ops per second and lock contention from the counter
+   deltas, heap size, free bytes, free runs, quick list bytes, tree depth and
+   purged bytes per arena. the process is not stopped or attached to. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "btff-internal.h"
+
+static double rate(unsigned long now, unsigned long then, double seconds)
+{
+	return now < then ? 0 : (now - then) / seconds;
+}
+
+static void show(struct stats* page, struct stats* last, double seconds)
+{
+	struct stats_heap total;
+	struct stats_heap* heap;
+	struct stats_heap* before;
+	int i;
+	memset(&total, 0, sizeof(total));
+	printf("\033[H\033[Jbtff pid %lu, %d arenas, refresh %lu ms, update %lu\n\n",
+		page->pid, page->heaps, page->interval, page->updated);
+	printf("%5s %10s %10s %10s %9s %12s %12s %9s %10s %5s %12s\n",
+		"arena", "malloc/s", "free/s", "realloc/s", "busy/s", "heap", "free", "runs", "quick", "depth", "purged");
+	for(i = 0; i < page->heaps && i < ARENA_SIZE; i++)
+	{
+		heap = &page->heap[i];
+		before = &last->heap[i];
+		printf("%5d %10.0f %10.0f %10.0f %9.0f %12lu %12lu %9lu %10lu %5d %12lu\n", i,
+			rate(heap->malloc, before->malloc, seconds), rate(heap->free, before->free, seconds),
+			rate(heap->realloc, before->realloc, seconds), rate(heap->contended, before->contended, seconds),
+			heap->size, heap->available, heap->runs, heap->quick, heap->depth, heap->purged);
+		total.malloc += heap->malloc - before->malloc;
+		total.free += heap->free - before->free;
+		total.realloc += heap->realloc - before->realloc;
+		total.contended += heap->contended - before->contended;
+		total.size += heap->size;
+		total.available += heap->available;
+		total.runs += heap->runs;
+		total.quick += heap->quick;
+		total.purged += heap->purged;
+	}
+	printf("%5s %10.0f %10.0f %10.0f %9.0f %12lu %12lu %9lu %10lu %5s %12lu\n", "all",
+		total.malloc / seconds, total.free / seconds, total.realloc / seconds, total.contended / seconds,
+		total.size, total.available, total.runs, total.quick, "", total.purged);
+	if(total.size)
+		printf("\nfree %.1f%% of the heap\n", 100.0 * total.available / total.size);
+	if(page->tlab)
+		printf("%lu bytes held in thread local buffers\n", page->tlab);
+	if(page->transfer)
+		printf("%lu bytes waiting in the transfer cache\n", page->transfer);
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	struct stats* page;
+	struct stats last;
+	char name[32];
+	double seconds;
+	pid_t pid;
+	int fd;
+	if(argc < 2 || !(pid = atoi(argv[1])))
+	{
+		fprintf(stderr, "usage: %s pid [seconds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	seconds = argc > 2 ? atof(argv[2]) : 1;
+	if(seconds <= 0)
+		seconds = 1;
+	snprintf(name, sizeof(name), "/btff.%d", (int)pid);
+	if(-1 == (fd = shm_open(name, O_RDONLY, 0)))
+	{
+		fprintf(stderr, "%s: no stats page /dev/shm%s, is BTFF_STATS set? %s\n", argv[0], name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	page = mmap(NULL, sizeof(struct stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == page || STATS_MAGIC != page->magic)
+	{
+		fprintf(stderr, "%s: %s is not a btff stats page\n", argv[0], name);
+		return EXIT_FAILURE;
+	}
+	last = *page;
+	while(!kill(pid, 0) || EPERM == errno)
+	{
+		usleep(seconds * 1000000);
+		show(page, &last, seconds);
+		last = *page;
+	}
+	return EXIT_SUCCESS;
+}
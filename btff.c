@@ -31,21 +31,38 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ------------------------------------------------------------------------------*/
 /* B Tree First Fit Memory Allocator */
 #include <stdlib.h>
+#include <limits.h>
 #include <malloc.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <pthread.h>
-#include "btff.h"
+#include "btff-internal.h"
+
+#ifdef BTFF_STATIC
+#define posix_memalign btff_core
+#endif
 
 static void *btff_memmove(register void *dest, register void *src, register int n);
-static void *btff_malloc(struct stack* stack, size_t size);
-static void btff_free(struct stack* stack, void *ptr);
-static void *btff_realloc(struct stack* stack, void *ptr, size_t* old_size, size_t size);
+static void *tree_malloc(struct stack* stack, size_t size);
+static void quick_free(struct stack* stack, void *ptr);
+static void tree_free(struct stack* stack, void *ptr, unsigned quick);
+static void sized_free(struct stack* stack, void *ptr, size_t size);
+static void *tree_realloc(struct stack* stack, void *ptr, size_t* old_size, size_t size);
+static void *tree_resize(struct stack* stack, void *ptr, size_t* old_size, size_t size, int move);
 static void *brk_memalign(struct stack* stack, size_t alignment, size_t size);
+static void *tree_memalign(struct stack* stack, size_t alignment, size_t size);
+static void *fit_malloc(struct stack* stack, size_t size, void* fit, unsigned long pad);
+static int defer_at(struct stack* stack, int level, void* ptr);
 static void sanity_check(void* p, int level, void* address_end);
 static void available_check(void* root, int level);
-static struct btff btff[1] = { { NULL, btff_memmove, brk, sbrk, btff_malloc, btff_free, btff_realloc, brk_memalign, sanity_check, available_check } };
+static int btff_purge(struct stack* stack, unsigned long age, int batch);
+static size_t usable_size(struct btff_heap* root, void* ptr, unsigned long version);
+static int rebuild(struct stack* stack, int fill);
+static void census(struct stack* stack, unsigned long* r_size, unsigned long* r_free, unsigned long* r_runs);
+static int recover(struct stack* stack);
+static void batch_free(struct stack* stack, void* list);
+static struct btff btff[1] = { { NULL, btff_memmove, brk, sbrk, tree_malloc, quick_free, tree_realloc, tree_memalign, sanity_check, available_check, btff_purge, sized_free, usable_size, rebuild, census, batch_free, NULL, tree_resize, recover } };
 
 int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
@@ -57,7 +74,7 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
 	else
 	{
 		size_t power;
-		for(power = 1 << 31; power >= sizeof(void*); power >>= 1)
+		for(power = (size_t)1 << 31; power >= sizeof(void*); power >>= 1)
 			if(alignment == power)
 				break;
 		if(power < sizeof(void*))
@@ -76,6 +93,8 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
 			struct stack stack[STACK];
 			void* ptr;
 			pthread_mutex_lock(&btff->root->mutex);
+			VERSION_ENTER(btff->root);
+			stack[HEAP].node = btff->root;
 			stack[ROOT].available = btff->root->available;
 			stack[ROOT].node = btff->root->node;
 			stack[LIST].node = btff->root->list;
@@ -84,13 +103,14 @@ int posix_memalign(void **memptr, size_t alignment, size_t size)
 				btff->root->available = stack[ROOT].available;
 			if(btff->root->list != stack[LIST].node)
 				btff->root->list = stack[LIST].node;
+			VERSION_LEAVE(btff->root);
 			pthread_mutex_unlock(&btff->root->mutex);
 			if(!ptr)
 				return ENOMEM;
 			*memptr = ptr;
 		}
 	}
-	return ENOMEM;
+	return 0;
 }
 
 #define DEBUG do { } while(0)
@@ -133,11 +153,11 @@ static inline void *btff_memmove(register void *dest, register void *src, regist
 	{	
 		if(dest < src || src + n <= dest)
 			for(n -= 4; n >= 0; n -= 4, dest += 4, src += 4)
-				(*(unsigned long*)dest) = (*(unsigned long*)src);
+				(*(uint32_t*)dest) = (*(uint32_t*)src);
 		else
 		if(src < dest)
 			for(n -= 4; n >= 0; n -=4)
-				(*(unsigned long*)(dest + n)) = (*(unsigned long*)(src + n));
+				(*(uint32_t*)(dest + n)) = (*(uint32_t*)(src + n));
 	}
 	return dest;
 }
@@ -145,6 +165,114 @@ static inline void *btff_memmove(register void *dest, register void *src, regist
 #define btff_memcpy(dest, src, n) btff_memmove(dest, src, n)
 #define GOTO_ERROR do { btff_perror(__FILE__);	btff_nerror(__LINE__); btff_perror(__FUNCTION__); goto ERROR; } while(0)
 
+/*----------------------------------------------------------------------------*/
+/* region providers: where a heap takes its address space from. the program
+   break, a range mapped up front (file or shared memory), or a range reserved
+   with PROT_NONE and committed as it is used. a heap in a range grows up from
+   begin to top, its tree is carved down from end to pool. */
+
+static void* brk_sbrk(struct btff_heap* root)
+{
+	return btff->sbrk(0);
+}
+
+static int brk_brk(struct btff_heap* root, void* address)
+{
+	return btff->brk(address);
+}
+
+static void* brk_page(struct btff_heap* root, long size)
+{
+	void* page;
+	if(MAP_FAILED == (page = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)))
+		return NULL;
+	return page;
+}
+
+static void* range_sbrk(struct btff_heap* root)
+{
+	return root->top;
+}
+
+static int range_brk(struct btff_heap* root, void* address)
+{
+	if(address < root->begin || root->pool < address)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	root->top = address;
+	return 0;
+}
+
+static void* range_page(struct btff_heap* root, long size)
+{
+	if(root->pool - root->top < size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return root->pool -= size;
+}
+
+static int reserve_brk(struct btff_heap* root, void* address)
+{
+	void* commit;
+	if(address < root->begin || root->pool < address)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	if(root->commit < address)
+	{
+		commit = (void*)(((unsigned long)address + COMMIT_SIZE - 1) & ~(COMMIT_SIZE - 1));
+		if(root->pool < commit)
+			commit = root->pool;
+		if(-1 == mprotect(root->commit, commit - root->commit, PROT_READ|PROT_WRITE))
+			return -1;
+		root->commit = commit;
+	}
+	return range_brk(root, address);
+}
+
+static void* reserve_page(struct btff_heap* root, long size)
+{
+	void* page;
+	if(!(page = range_page(root, size)))
+		return NULL;
+	if(-1 == mprotect(page, size, PROT_READ|PROT_WRITE))
+	{
+		root->pool += size;
+		return NULL;
+	}
+	return page;
+}
+
+static struct provider
+{
+	void* (*sbrk)(struct btff_heap* root);
+	int (*brk)(struct btff_heap* root, void* address);
+	void* (*page)(struct btff_heap* root, long size);
+} provider[] = {
+	{ brk_sbrk, brk_brk, brk_page },
+	{ range_sbrk, range_brk, range_page },
+	{ range_sbrk, reserve_brk, reserve_page } };
+
+#define heap_sbrk(stack) provider[ROOT_OF(stack)->provider].sbrk(ROOT_OF(stack))
+#define heap_page(stack, size) provider[ROOT_OF(stack)->provider].page(ROOT_OF(stack), (size))
+
+/* once there is a tree its runs end at the brk, the heap size moves with it */
+static inline int heap_brk(struct stack* stack, void* address)
+{
+	struct btff_heap* root = ROOT_OF(stack);
+	void* top = provider[root->provider].sbrk(root);
+	if(-1 == provider[root->provider].brk(root, address))
+		return -1;
+	if(root->node)
+		root->heap_size += address - top;
+	return 0;
+}
+
 /*----------------------------------------------------------------------------*/
 
 struct list
@@ -152,6 +280,9 @@ struct list
 	struct list* next;
 };
 
+/* a cell holds a leaf or a node, a node of 64-bit pointers takes two */
+#define CELL_SIZE (sizeof(struct node) <= 64 ? 64 : 128)
+
 static inline void delete64byte(register struct stack* stack, register void* delete)
 {
 	register struct list* list = stack[LIST].node;
@@ -170,12 +301,12 @@ static inline void* new64byte(register struct stack* stack)
 		register int i;
 		if(!size)
 			size = sysconf(_SC_PAGESIZE);
-		if(!(new = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)))
+		if(!(new = heap_page(stack, size)))
 		{
 			btff_perror(sys_errlist[errno]);
 			exit(EXIT_FAILURE);
 		}
-		for(i = 0; i < size; i += 64)
+		for(i = 0; i < size; i += CELL_SIZE)
 			delete64byte(stack, new + i);
 		list = stack[LIST].node;
 	}
@@ -190,6 +321,212 @@ static inline void* new64byte(register struct stack* stack)
 #define new_leaf(stack) ((struct leaf*)new64byte(stack))
 #define delete_leaf(stack, leaf) delete64byte(stack, (void*)leaf)
 
+/*----------------------------------------------------------------------------*/
+/* segregated fit index: free runs bucketed by power of two size class.
+   the list entry lives in the free run itself, the tree stays authoritative. */
+
+struct run
+{
+	struct run* next;
+	struct run** prev;
+	unsigned long size;
+	unsigned long epoch;
+};
+
+#define PURGED (~0UL)
+
+#define index_class(size) ((int)(INDEX_SIZE - 1 - __builtin_clzl(size)))
+
+static inline void index_insert(struct stack* stack, register void* address, register unsigned long size)
+{
+	register struct run* run = address;
+	register struct run** head;
+	register int class;
+	ROOT_OF(stack)->free_size += size;
+	ROOT_OF(stack)->free_runs++;
+	if(size < sizeof(struct run))
+		return;
+	class = index_class(size);
+	head = (struct run**)&ROOT_OF(stack)->index[class];
+	if((run->next = *head))
+		run->next->prev = &run->next;
+	run->prev = head;
+	run->size = size;
+	run->epoch = ROOT_OF(stack)->epoch;
+	*head = run;
+	ROOT_OF(stack)->bitmap |= 1UL << class;
+}
+
+static inline void index_delete(struct stack* stack, register void* address, register unsigned long size)
+{
+	register struct run* run = address;
+	register int class;
+	ROOT_OF(stack)->free_size -= size;
+	ROOT_OF(stack)->free_runs--;
+	if(size < sizeof(struct run))
+		return;
+	if(ROOT_OF(stack)->purge == run)
+		ROOT_OF(stack)->purge = run->next;
+	if((*run->prev = run->next))
+		run->next->prev = run->prev;
+	class = index_class(size);
+	if(!ROOT_OF(stack)->index[class])
+		ROOT_OF(stack)->bitmap &= ~(1UL << class);
+}
+
+static inline void* index_search(struct stack* stack, register unsigned long size)
+{
+	register unsigned long bitmap;
+	register struct run* run;
+	register int class;
+	if(size < sizeof(struct run))
+		size = sizeof(struct run);
+	class = index_class(size);
+	if((run = ROOT_OF(stack)->index[class]) && size <= run->size)
+		return run;
+	if(++class >= INDEX_SIZE)
+		return NULL;
+	if(!(bitmap = ROOT_OF(stack)->bitmap & (~0UL << class)))
+		return NULL;
+	return ROOT_OF(stack)->index[__builtin_ctzl(bitmap)];
+}
+
+/* purge: the whole pages of runs free for age epochs or more go back to the
+   system, the run header stays. decayed runs are freed lazily, a trim with
+   age 0 drops them at once. the cursor in the root keeps the place in the
+   index between batches, returns 1 once a sweep is complete. */
+
+#ifndef MADV_FREE
+#define MADV_FREE MADV_DONTNEED
+#endif
+
+static unsigned long purge_page;
+
+static void run_purge(struct btff_heap* root, struct run* run, unsigned long age)
+{
+	unsigned long begin;
+	unsigned long end;
+	begin = ((unsigned long)(run + 1) + purge_page - 1) & ~(purge_page - 1);
+	end = ((unsigned long)run + run->size) & ~(purge_page - 1);
+	if(begin < end)
+	{
+		if(!age || -1 == madvise((void*)begin, end - begin, MADV_FREE))
+			madvise((void*)begin, end - begin, MADV_DONTNEED);
+		root->purged += end - begin;
+	}
+	run->epoch = PURGED;
+}
+
+/* a run freed at release size or more goes back at once, where other
+   mallocs would have mapped the block and unmap it on free */
+static inline void index_release(struct stack* stack, void* address, unsigned long size)
+{
+	register struct btff_heap* root = ROOT_OF(stack);
+	if(!root->release || size < root->release || size < sizeof(struct run) || PROVIDER_MAP == root->provider)
+		return;
+	if(!purge_page)
+		purge_page = sysconf(_SC_PAGESIZE);
+	run_purge(root, address, 0);
+}
+
+static int btff_purge(struct stack* stack, unsigned long age, int batch)
+{
+	register struct btff_heap* root = ROOT_OF(stack);
+	register struct run* run;
+	if(PROVIDER_MAP == root->provider)
+		return 1;
+	if(!purge_page)
+		purge_page = sysconf(_SC_PAGESIZE);
+	if(root->purge_class < index_class(purge_page))
+		root->purge_class = index_class(purge_page);
+	while(0 < batch--)
+	{
+		while(!root->purge)
+		{
+			if(INDEX_SIZE <= root->purge_class)
+			{
+				root->purge_class = 0;
+				return 1;
+			}
+			root->purge = root->index[root->purge_class++];
+		}
+		run = root->purge;
+		root->purge = run->next;
+		if(PURGED == run->epoch || root->epoch - run->epoch < age)
+			continue;
+		run_purge(root, run, age);
+	}
+	return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+/* quick lists: small blocks stay allocated in the tree after free and are
+   handed out again by exact size. coalescing is deferred to quick_flush. */
+
+#define quick_class(size) ((int)((size) / ALIGNMENT) - 1)
+
+static inline void* quick_pop(struct stack* stack, size_t size)
+{
+	register struct list** head = (struct list**)&ROOT_OF(stack)->quick[quick_class(size)];
+	register struct list* list;
+	if((list = *head))
+	{
+		*head = list->next;
+		ROOT_OF(stack)->quick_size[quick_class(size)]--;
+		ROOT_OF(stack)->quick_total--;
+	}
+	return list;
+}
+
+static void quick_flush(struct stack* stack, int class, int keep)
+{
+	register struct list** head = (struct list**)&ROOT_OF(stack)->quick[class];
+	register struct list* list;
+	for( ; 0 < keep && *head; keep--)
+		head = &(*head)->next;
+	while((list = *head))
+	{
+		*head = list->next;
+		ROOT_OF(stack)->quick_size[class]--;
+		ROOT_OF(stack)->quick_total--;
+		tree_free(stack, list, 0);
+	}
+}
+
+/* an overflowing list is offered to the spill hook first, which takes the
+   blocks past keep as one batch, still allocated in the tree */
+static int quick_spill(struct stack* stack, int class, int keep)
+{
+	register struct list** head = (struct list**)&ROOT_OF(stack)->quick[class];
+	register struct list* list;
+	int count;
+	for( ; 0 < keep && *head; keep--)
+		head = &(*head)->next;
+	if(!(list = *head))
+		return 0;
+	count = ROOT_OF(stack)->quick_size[class] - ROOT_OF(stack)->cache / 2;
+	*head = NULL;
+	if(!btff->spill(ROOT_OF(stack), class, list, count))
+	{
+		*head = list;
+		return 0;
+	}
+	ROOT_OF(stack)->quick_size[class] -= count;
+	ROOT_OF(stack)->quick_total -= count;
+	return 1;
+}
+
+static inline void quick_push(struct stack* stack, void* ptr, size_t size)
+{
+	register int class = quick_class(size);
+	((struct list*)ptr)->next = ROOT_OF(stack)->quick[class];
+	ROOT_OF(stack)->quick[class] = ptr;
+	ROOT_OF(stack)->quick_total++;
+	if(ROOT_OF(stack)->cache < ++ROOT_OF(stack)->quick_size[class])
+		if(!btff->spill || !quick_spill(stack, class, ROOT_OF(stack)->cache / 2))
+			quick_flush(stack, class, ROOT_OF(stack)->cache / 2);
+}
+
 /*----------------------------------------------------------------------------*/
 
 static inline unsigned char* _leaf_next(register unsigned char* p, unsigned long* r_size)
@@ -279,13 +616,107 @@ static void* leaf_address_end(struct leaf* leaf)
 	return address + size;
 }
 
+/* leaf summary: the offsets, plus one, of the largest and the second largest
+   free run. 0 is not known, SUMMARY_NONE there is no such run. leaf_update
+   keeps them up to date, leaf_max fills them in with one scan. */
+
+#define SUMMARY_NONE 0xff
+#define summary_reset(leaf) ((leaf)->max = (leaf)->second = 0)
+
+static inline unsigned long summary_value(struct leaf* leaf, unsigned char offset)
+{
+	unsigned long value;
+	if(SUMMARY_NONE == offset)
+		return 0;
+	leaf_next(leaf->available + offset - 1, &value);
+	return value;
+}
+
+static inline void summary_drop(struct leaf* leaf, unsigned char* begin, unsigned char* end, int delta)
+{
+	int b = begin - leaf->available + 1;
+	int e = end - leaf->available + 1;
+	if(b <= leaf->second && leaf->second < e)
+		leaf->second = 0;
+	else
+	if(e <= leaf->second && SUMMARY_NONE != leaf->second)
+		leaf->second += delta;
+	if(b <= leaf->max && leaf->max < e)
+	{
+		leaf->max = leaf->second;
+		leaf->second = 0;
+	}
+	else
+	if(e <= leaf->max && SUMMARY_NONE != leaf->max)
+		leaf->max += delta;
+}
+
+static inline void summary_add(struct leaf* leaf, unsigned char* begin, unsigned char* end)
+{
+	unsigned char* next;
+	unsigned long value;
+	if(!leaf->max)
+		return;
+	for( ; begin < end; begin = next)
+	{
+		next = leaf_next(begin, &value);
+		if(!(next[-1] & AVAILABLE))
+			continue;
+		if(summary_value(leaf, leaf->max) <= value)
+		{
+			leaf->second = leaf->max;
+			leaf->max = begin - leaf->available + 1;
+		}
+		else
+		if(leaf->second && summary_value(leaf, leaf->second) < value)
+			leaf->second = begin - leaf->available + 1;
+	}
+}
+
+static unsigned long leaf_max(struct leaf* leaf)
+{
+	register unsigned char* begin;
+	register unsigned char* end;
+	unsigned char* leaf_end;
+	unsigned long value;
+	unsigned long max;
+	unsigned long second;
+	if(!leaf->max)
+	{
+		leaf->max = leaf->second = SUMMARY_NONE;
+		for(begin = leaf->available, leaf_end = leaf->available + (int)leaf->size, max = second = 0; begin < leaf_end; begin = end)
+		{
+			end = leaf_next(begin, &value);
+			if(!(end[-1] & AVAILABLE))
+				continue;
+			if(SUMMARY_NONE == leaf->max || max <= value)
+			{
+				leaf->second = leaf->max;
+				second = max;
+				leaf->max = begin - leaf->available + 1;
+				max = value;
+			}
+			else
+			if(SUMMARY_NONE == leaf->second || second < value)
+			{
+				leaf->second = begin - leaf->available + 1;
+				second = value;
+			}
+		}
+		return max;
+	}
+	return summary_value(leaf, leaf->max);
+}
+
 static unsigned char* leaf_update(struct leaf* leaf, unsigned char* begin, unsigned char* end, unsigned char* tmp_begin, unsigned char* tmp_end)
 {
 	unsigned char* new_end = begin + (tmp_end - tmp_begin);
+	summary_drop(leaf, begin, end, (tmp_end - tmp_begin) - (end - begin));
 	btff_memmove(new_end, end, leaf->size - (end - leaf->available));
 	btff_memcpy(begin, tmp_begin, tmp_end - tmp_begin);
 	leaf->size -= end - begin;
 	leaf->size += tmp_end - tmp_begin;
+	summary_add(leaf, begin, new_end);
 	return new_end;
 }
 
@@ -421,6 +852,93 @@ static inline void leaf_overflow(struct leaf* leaf)
 	leaf->size = LEAF_SIZE;
 }
 
+/* paths: the child taken at each level packed three bits a level, low bits
+   first from ROOT. the finger keeps the path of the leaf touched last, the
+   radix map the path of the leaf last found for each page. a path is only a
+   hint, it is replayed from ROOT and holds if it still leads to a leaf whose
+   range, from the leaf address to the nearest separator to the right on the
+   path, has ptr in it. */
+
+#define RADIX_SHIFT 12
+#define RADIX_STEP ((((sizeof(void*) < 8 ? 32 : 48) - RADIX_SHIFT) + 2) / 3)
+#define RADIX_SIZE (1UL << RADIX_STEP)
+#define RADIX_DEPTH ((int)(sizeof(unsigned long) * 8 - 1) / 3)
+
+static unsigned long* radix_slot(struct stack* stack, void* ptr, int create)
+{
+	register unsigned long key = (unsigned long)ptr >> RADIX_SHIFT;
+	register void** table = &ROOT_OF(stack)->radix;
+	register int shift;
+	register unsigned long i;
+	if(key >> (3 * RADIX_STEP))
+		return NULL;
+	for(shift = 2 * RADIX_STEP; 0 <= shift; shift -= RADIX_STEP)
+	{
+		if(!*table)
+		{
+			if(!create || !(*table = heap_page(stack, RADIX_SIZE * sizeof(void*))))
+				return NULL;
+			for(i = 0; i < RADIX_SIZE; i++)
+				((void**)*table)[i] = NULL;
+		}
+		table = (void**)*table + ((key >> shift) & (RADIX_SIZE - 1));
+	}
+	return (unsigned long*)table;
+}
+
+static inline void path_set(struct stack* stack, void* ptr)
+{
+	register unsigned long path;
+	register unsigned long* slot;
+	register int level;
+	if(RADIX_DEPTH < LEAF - ROOT)
+		return;
+	for(path = 0, level = LEAF - 1; level >= ROOT; level--)
+		path = path << 3 | stack[level].child;
+	path = path << 1 | 1;
+	ROOT_OF(stack)->finger = path;
+	if((slot = radix_slot(stack, ptr, 1)))
+		*slot = path;
+}
+
+static inline struct leaf* path_replay(struct stack* stack, void* ptr, unsigned long path)
+{
+	register struct node* node;
+	register struct leaf* leaf;
+	register int level;
+	register int i;
+	void* bound;
+	if(!path || RADIX_DEPTH < LEAF - ROOT)
+		return NULL;
+	for(path >>= 1, level = ROOT, bound = NULL; level < LEAF; level++, path >>= 3)
+	{
+		node = stack[level].node;
+		i = path & 7;
+		if((i & 1) || node->size <= i || LEVEL(node->address[i]) != level + 1)
+			return NULL;
+		if(i + 1 < node->size)
+			bound = node->address[i + 1];
+		stack[level].child = i;
+		stack[level + 1].available = node->available[i];
+		stack[level + 1].node = node->address[i];
+	}
+	leaf = stack[LEAF].node;
+	if(!leaf || ptr < leaf->address || (bound && bound <= ptr))
+		return NULL;
+	return leaf;
+}
+
+static inline struct leaf* path_search(struct stack* stack, void* ptr)
+{
+	register struct leaf* leaf;
+	register unsigned long* slot;
+	if((leaf = path_replay(stack, ptr, ROOT_OF(stack)->finger)))
+		return leaf;
+	if((slot = radix_slot(stack, ptr, 0)) && *slot != ROOT_OF(stack)->finger)
+		return path_replay(stack, ptr, *slot);
+	return NULL;
+}
+
 static int node_search_available(struct stack* stack, int level, size_t size, void (*split)(struct stack*, int, int), int* r_i)
 {
 	for( ; level < LEAF; level++)
@@ -469,8 +987,6 @@ static int node_search_address(struct stack* stack, int level, void* ptr, void (
 		RESUME:
 			if(ptr == node->address[i])
 			{
-				if(0 < node->available[i])
-					return -1;
 				if(r_i)
 					*r_i = i;
 				return level;
@@ -670,6 +1186,7 @@ static void node_split(struct stack* stack, int level, int i)
 					max = value;
 		}
 		left->size = middle - left->available;
+		summary_reset(left);
 		parent->available[i] = max;
 
 		parent->address[i + 1] = address;
@@ -678,6 +1195,7 @@ static void node_split(struct stack* stack, int level, int i)
 		right = parent->address[i + 2] = new_leaf(stack);
 		right->address = address + value;
 		right->size = 0;
+		summary_reset(right);
 		for(begin = end, max = 0; begin < left->available + LEAF_SIZE; begin = end)
 		{
 			end = leaf_next(begin, &value);
@@ -697,6 +1215,9 @@ static void node_split(struct stack* stack, int level, int i)
 		}
 		parent->available[i + 2] = max;
 	}
+	/* a full parent is split ahead, before a leaf overflow has to cascade through it */
+	if(ROOT_OF(stack)->steps && is_overflow(stack, level))
+		defer_at(stack, level, parent->address[i + 1]);
 }
 
 static unsigned node_merge(struct stack* stack, int level, int middle)
@@ -826,6 +1347,8 @@ static void node_rebalance(struct stack* stack, int level, int middle)
 	{
 		struct leaf* left = parent->address[middle - 1];
 		struct leaf* right = parent->address[middle + 1];
+		summary_reset(left);
+		summary_reset(right);
 		if(left->size + 10 <= right->size)
 		{
 			register void* address;
@@ -926,6 +1449,33 @@ RETURN:
 	}
 }
 
+/* bounded restructuring: with root->steps set an operation merges or splits
+   ahead at most that many levels. the rest is left pending, one entry per
+   level: root->defer[level] is an address under the node still to be fixed,
+   bit level of root->deferred says the entry is there, for settle on the
+   next entry. a level already pending is not written over: a merge is then
+   done at once, a full node is left to be split when a leaf needs it. merges
+   and splits keep the multiset of runs under each node, so the available
+   maxima above a node left as it is stay right. */
+static int defer_at(struct stack* stack, int level, void* ptr)
+{
+	struct btff_heap* root = ROOT_OF(stack);
+	if(root->deferred & (1UL << level))
+		return 0;
+	root->deferred |= 1UL << level;
+	root->defer[level] = ptr;
+	return 1;
+}
+
+static int defer(struct stack* stack, int level)
+{
+	void* p = stack[level].node;
+	int i;
+	for(i = level; i < LEAF; i++)
+		p = ((struct node*)p)->address[0];
+	return defer_at(stack, level, ((struct leaf*)p)->address);
+}
+
 static unsigned is_underflow(struct stack* stack, int level)
 {
 	if(level < LEAF)
@@ -992,14 +1542,14 @@ static int overflow(struct stack* stack, int level)
 	node->address[0] = stack[ROOT].node;
 	node->available[0] = stack[ROOT].available;
 	node->size = 1;
-	btff->root->node = node;
+	ROOT_OF(stack)->node = node;
 	stack[ROOT].node = node;
 	stack[ROOT].available = node_available(node->available, node->size);
 	stack[ROOT].child = 0;
 	return ROOT;
 }
 
-static int rebalance(struct stack* stack, int level)
+static int rebalance_steps(struct stack* stack, int level, int* steps)
 {	
 	struct node* node;
 	while(level > ROOT)
@@ -1010,6 +1560,10 @@ static int rebalance(struct stack* stack, int level)
 		int i;
 		if(!is_underflow(stack, level))
 			return level;
+		/* a node down to one child waits too: a merge below it finds no
+		   sibling and stops, the node itself is pending */
+		if((*steps)-- <= 0 && level < LEAF && defer(stack, level))
+			return level;
 		level--;
 		node = stack[level].node;
 		i = stack[level].child;	
@@ -1060,7 +1614,7 @@ static int rebalance(struct stack* stack, int level)
 		{
 			if(LEVEL(node->address[0]) != ROOT + 1)
 				GOTO_ERROR;
-			btff->root->node = node->address[0];
+			ROOT_OF(stack)->node = node->address[0];
 			delete_node(stack, node);
 		}
 	}
@@ -1070,7 +1624,7 @@ static int rebalance(struct stack* stack, int level)
 		if(leaf->size == 0)
 		{
 		DEBUG;
-			btff->root->node = NULL;
+			ROOT_OF(stack)->node = NULL;
 			delete_leaf(stack, leaf);
 			stack[LEAF].available = 0;
 			stack[LEAF].node = NULL;
@@ -1086,6 +1640,77 @@ ERROR:
 	return -1;
 }
 
+static int rebalance(struct stack* stack, int level)
+{
+	int steps = ROOT_OF(stack)->steps ? ROOT_OF(stack)->steps : LEAF;
+	return rebalance_steps(stack, level, &steps);
+}
+
+/* the pending levels are taken top down. the walk to a deferred address
+   splits the full nodes on it or moves half into a sibling, the node at the
+   level is then merged up if it still underflows. a fix only leaves work at levels above its own,
+   which were taken already, so it finds their entries free. splits and
+   merges come out of the one budget, an entry it does not cover is put
+   back for the next entry. */
+static void settle(struct stack* stack)
+{
+	struct btff_heap* root = ROOT_OF(stack);
+	struct node* node;
+	void* ptr;
+	int steps = root->steps ? root->steps : INT_MAX;
+	int target;
+	int level;
+	int i;
+	while(root->deferred)
+	{
+		target = __builtin_ctzl(root->deferred);
+		ptr = root->defer[target];
+		root->deferred &= ~(1UL << target);
+		if(!stack[ROOT].node || target < ROOT)
+			continue;
+		if(steps <= 0)
+			goto PENDING;
+		if(is_overflow(stack, ROOT))
+		{
+			overflow(stack, ROOT);
+			steps--;
+		}
+		for(level = ROOT; level < target; level++)
+		{
+		RESUME:
+			node = stack[level].node;
+			for(i = 0; i + 1 < node->size && node->address[i + 1] <= ptr; i += 2);
+			stack[level].child = i;
+			stack[level + 1].available = node->available[i];
+			stack[level + 1].node = node->address[i];
+			if(is_overflow(stack, level + 1))
+			{
+				if(steps <= 0)
+					goto PENDING;
+				/* a sibling with room takes half instead, a split would
+				   leave two halves that underflow */
+				if(i + 2 < node->size && ((struct node*)node->address[i + 2])->size + 4 <= NODE_SIZE)
+					node_rebalance(stack, level, i + 1);
+				else
+				if(2 <= i && ((struct node*)node->address[i - 2])->size + 4 <= NODE_SIZE)
+					node_rebalance(stack, level, i - 1);
+				else
+					node_split(stack, level, i);
+				steps--;
+				goto RESUME;
+			}
+		}
+		if(ROOT < target && is_underflow(stack, target))
+			rebalance_steps(stack, target, &steps);
+		continue;
+	PENDING:
+		defer_at(stack, target, ptr);
+		return;
+	}
+}
+
+#define SETTLE(stack) do { if(ROOT_OF(stack)->deferred) settle(stack); } while(0)
+
 /*----------------------------------------------------------------------------*/
 
 static void brk_adjust(struct stack* stack, void* ptr)
@@ -1102,17 +1727,18 @@ static void brk_adjust(struct stack* stack, void* ptr)
 	{
 		if(ROOT != LEAF)
 			GOTO_ERROR;
-		address = btff->sbrk(0);
+		address = heap_sbrk(stack);
 		if(address < (void*)LEAF)
 			address = (void*)LEAF;
 		while(0x00000003 & (unsigned long)address)
 			address++;
-		if(-1 == btff->brk(address))
+		if(-1 == heap_brk(stack, address))
 			GOTO_ERROR;
 		leaf = new_leaf(stack);
 		leaf->address = address;
 		leaf->size = 0;
-		btff->root->node = leaf;
+		summary_reset(leaf);
+		ROOT_OF(stack)->node = leaf;
 		stack[LEAF].node = leaf;
 		stack[LEAF].available = 0;
 	}
@@ -1121,13 +1747,13 @@ static void brk_adjust(struct stack* stack, void* ptr)
 		level = ROOT;
 	REPEAT:
 		leaf = far_right_leaf(stack, level, split);
-		address = btff->sbrk(0);
+		address = heap_sbrk(stack);
 	}
 	begin = tmp;
 	end = leaf_append(begin, ptr - address);
 	if(leaf->size + (end - begin) <= LEAF_SIZE)
 	{
-		if(-1 == btff->brk(ptr))
+		if(-1 == heap_brk(stack, ptr))
 			GOTO_ERROR;
 		leaf_update(leaf, leaf->available + (int)leaf->size, leaf->available + (int)leaf->size, begin, end);
 	}
@@ -1146,30 +1772,86 @@ ERROR:
 		btff_perror(sys_errlist[errno]);
 }
 
+/* the program break cannot be moved: carry on in a reserved range above it.
+   the hole in between stays allocated for good. a reserved heap without a
+   range yet gets its first one here. */
+static int heap_fallback(struct stack* stack)
+{
+	struct btff_heap* root = ROOT_OF(stack);
+	struct leaf* leaf;
+	void* top;
+	void* range;
+	unsigned char tmp[12];
+	unsigned char* begin;
+	unsigned char* end;
+	if(PROVIDER_BRK != root->provider && (PROVIDER_RESERVE != root->provider || root->begin))
+		return 0;
+	if(MAP_FAILED == (range = mmap(NULL, RESERVE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0)))
+		return 0;
+	leaf = stack[ROOT].node ? far_right_leaf(stack, ROOT, NULL) : NULL;
+	top = leaf ? leaf_address_end(leaf) : range;
+	if(range < top)
+	{
+		munmap(range, RESERVE_SIZE);
+		return 0;
+	}
+	root->begin = root->top = root->commit = range;
+	root->end = root->pool = range + RESERVE_SIZE;
+	root->provider = PROVIDER_RESERVE;
+	if(top < range)
+	{
+		root->heap_size += range - top;
+		begin = tmp;
+		end = leaf_append(begin, range - top);
+		if(LEAF_SIZE < leaf->size + (end - begin))
+		{
+			leaf_overflow(leaf);
+			leaf = far_right_leaf(stack, overflow(stack, LEAF), node_split);
+		}
+		leaf_update(leaf, leaf->available + (int)leaf->size, leaf->available + (int)leaf->size, begin, end);
+	}
+	return 1;
+}
+
 void *brk_memalign(struct stack* stack, size_t alignment, size_t size)
 {
 	struct leaf* leaf;
 	void* address;
+	void* address_end;
 	unsigned char tmp[12];
 	unsigned long left_available;
 	unsigned char* begin;
 	unsigned char* end;
 	unsigned long available;
+	if(size % alignment)
+	{
+		size /= alignment;
+		size++;
+		size *= alignment;
+	}
+	while((ALIGNMENT - 1) & size)
+		size++;
+GROW:
 	if(!stack[ROOT].node)
 	{
 		if(ROOT != LEAF)
 			GOTO_ERROR;
-		address = btff->sbrk(0);
+		address = heap_sbrk(stack);
 		if(address < (void*)LEAF)
 			address = (void*)LEAF;
 		while((ALIGNMENT - 1) & (unsigned long)address)
 			address++;
-		if(-1 == btff->brk(address))
-			GOTO_ERROR;
+		if(-1 == heap_brk(stack, address))
+		{
+			if(heap_fallback(stack))
+				goto GROW;
+			return NULL;
+		}
 		leaf = new_leaf(stack);
 		leaf->address = address;
 		leaf->size = 0;
-		btff->root->node = leaf;
+		summary_reset(leaf);
+		ROOT_OF(stack)->node = leaf;
 		stack[LEAF].node = leaf;
 		stack[LEAF].available = 0;
 	}
@@ -1177,35 +1859,38 @@ void *brk_memalign(struct stack* stack, size_t alignment, size_t size)
 		leaf = far_right_leaf(stack, ROOT, NULL);
 	end = leaf->available + (int)leaf->size;
 	if(end[-1] & AVAILABLE)
-	{
 		end = leaf_last(leaf, &left_available, &begin, &address, &available);
-		leaf_update(leaf, begin, end, NULL, NULL);
-		if(stack[LEAF].available == available)
-		{
-			stack[LEAF].available = left_available;
-			available_decrease(stack, LEAF - 1);
-		}
-	}
 	else
-		address = btff->sbrk(0);
-	if(size % alignment)
 	{
-		size /= alignment;
-		size++;
-		size *= alignment;
+		begin = NULL;
+		address = heap_sbrk(stack);
 	}
-	while((ALIGNMENT - 1) & size)
-		size++;
-	if((unsigned long)address % (unsigned long)alignment)
 	{
-		void* address_end;
+		unsigned long value = (unsigned long)address;
+		value += alignment - 1;
+		value /= alignment;
+		value *= alignment;
+		address_end = (void*)value;
+	}
+	/* grow first, the tree is left alone when the heap cannot */
+	if(-1 == heap_brk(stack, address_end + size))
+	{
+		if(heap_fallback(stack))
+			goto GROW;
+		return NULL;
+	}
+	if(begin)
+	{
+		index_delete(stack, address, available);
+		leaf_update(leaf, begin, end, NULL, NULL);
+		if(stack[LEAF].available == available)
 		{
-			unsigned long value = (unsigned long)address;
-			value /= alignment;
-			value++;
-			value *= alignment;
-			address_end = (void*)value;
+			stack[LEAF].available = left_available;
+			available_decrease(stack, LEAF - 1);
 		}
+	}
+	if(address < address_end)
+	{
 		available = address_end - address;
 		begin = tmp;
 		end = leaf_append(begin, available);
@@ -1215,9 +1900,8 @@ void *brk_memalign(struct stack* stack, size_t alignment, size_t size)
 			leaf_overflow(leaf);
 			leaf = far_right_leaf(stack, overflow(stack, LEAF), node_split);
 		}
-		if(-1 == btff->brk(address_end))
-			GOTO_ERROR;
 		leaf_update(leaf, leaf->available + (int)leaf->size, leaf->available + (int)leaf->size, begin, end);
+		index_insert(stack, address, available);
 		if(stack[LEAF].available < available)
 		{
 			stack[LEAF].available = available;
@@ -1232,8 +1916,6 @@ void *brk_memalign(struct stack* stack, size_t alignment, size_t size)
 		leaf_overflow(leaf);
 		leaf = far_right_leaf(stack, overflow(stack, LEAF), node_split);
 	}
-	if(-1 == btff->brk(address + size))
-		GOTO_ERROR;
 	leaf_update(leaf, leaf->available + (int)leaf->size, leaf->available + (int)leaf->size, begin, end);
 	return address;
 ERROR:
@@ -1243,32 +1925,72 @@ ERROR:
 	return NULL;
 }
 
-static void* btff_malloc(struct stack* stack, size_t size)
+static void* tree_malloc(struct stack* stack, size_t size)
 {
-	void* ptr;
+	void* ptr = NULL;
+	int i;
+	if(size == 0)
+		goto RETURN;
+	SETTLE(stack);
+	while(size & (ALIGNMENT - 1))
+		size++;
+	if(size <= QUICK_MAX && (ptr = quick_pop(stack, size)))
+		goto RETURN;
+	if(stack[ROOT].available < size)
+	{
+		if(!ROOT_OF(stack)->quick_total)
+			return brk_memalign(stack, ALIGNMENT, size);
+		for(i = 0; i < QUICK_SIZE; i++)
+			quick_flush(stack, i, 0);
+		if(stack[ROOT].available < size)
+			return brk_memalign(stack, ALIGNMENT, size);
+	}
+	return fit_malloc(stack, size, BTFF_PLACE_FIRST == ROOT_OF(stack)->policy ? NULL : index_search(stack, size), 0);
+RETURN:
+	return ptr;
+}
+
+/* an aligned block is cut from a free run that holds it with the worst case
+   padding, the padding in front stays free */
+static void* tree_memalign(struct stack* stack, size_t alignment, size_t size)
+{
+	void* fit;
+	if(alignment <= ALIGNMENT)
+		return tree_malloc(stack, size);
+	SETTLE(stack);
+	while(size & (ALIGNMENT - 1))
+		size++;
+	if(stack[ROOT].available < size + alignment - ALIGNMENT || !(fit = index_search(stack, size + alignment - ALIGNMENT)))
+		return brk_memalign(stack, alignment, size);
+	return fit_malloc(stack, size, fit, -(unsigned long)fit & (alignment - 1));
+}
+
+/* takes size from the free run at fit, or the first that holds it. pad bytes
+   in front of the block stay free, the run is split once. */
+static void* fit_malloc(struct stack* stack, size_t size, void* fit, unsigned long pad)
+{
+	void* ptr = NULL;
 	int level;
 	struct node* node;
 	int middle_level;
 	struct leaf* leaf;
-	unsigned char tmp[12];
+	unsigned char tmp[18];
 	unsigned char* begin;
 	unsigned char* end;
 	void* address;
 	unsigned long available;
 	unsigned long old_available;
-	unsigned long left_available;
 	int i;
 	void (*split)(struct stack*, int, int);
 	split = NULL;
-	if(size == 0)
-		goto RETURN;
-	while(size & (ALIGNMENT - 1))
-		size++;
-	if(stack[ROOT].available < size)
-		return brk_memalign(stack, ALIGNMENT, size);
+	if(fit && (leaf = path_search(stack, fit)))
+	{
+		level = LEAF;
+		GOTO_LEAF_SEARCH;
+	}
 	level = ROOT;
 NODE_SEARCH:
-	if(LEAF > (level = node_search_available(stack, level, size, split, &i)))
+	if(LEAF > (level = fit ? node_search_address(stack, level, fit, split, &i) : node_search_available(stack, level, size, split, &i)))
 	{
 		node = stack[level].node;
 		middle_level = level;
@@ -1282,16 +2004,24 @@ NODE_SEARCH:
 	else
 		GOTO_ERROR;
 /* NODE_FOUND: */
-	if(size < node->available[i])
+	if(node->available[i] < pad + size)
+		GOTO_ERROR;
+	if(pad || size < node->available[i])
 	{
 	DEBUG;
-		available = node->available[i] - size;
+		available = node->available[i] - pad - size;
 		if(!(leaf = right_leaf(stack, middle_level, split, &i)))
 			GOTO_ERROR;
 	SPLIT:
+		/* with padding the separator keeps the padding and the block moves
+		   into the leaf ahead of the rest */
 		begin = tmp;
-		end = leaf_append(begin, available);
-		end[-1] |= AVAILABLE;
+		end = pad ? leaf_append(begin, size) : begin;
+		if(available)
+		{
+			end = leaf_append(end, available);
+			end[-1] |= AVAILABLE;
+		}
 		if(LEAF_SIZE < leaf->size + (end - begin))
 		{
 		DEBUG;
@@ -1317,21 +2047,32 @@ NODE_SEARCH:
 				goto SPLIT;
 			}
 		}
+		index_delete(stack, node->address[i], node->available[i]);
 		old_available = node->available[i];
-		node->available[i] = size;
+		node->available[i] = pad ? pad : size;
 		if(stack[middle_level].available == old_available)
 		{
 			stack[middle_level].available = node_available(node->available, node->size);
 			available_decrease(stack, middle_level - 1);
 		}
-		leaf->address -= available;
+		leaf->address -= (pad ? size : 0) + available;
 		leaf_update(leaf, leaf->available, leaf->available, begin, end);
+		if(available)
+			index_insert(stack, leaf->address + (pad ? size : 0), available);
 		if(stack[LEAF].available < available)
 		{
 			stack[LEAF].available = available;
 			available_increase(stack, LEAF - 1);
 		}
+		if(pad)
+		{
+			index_insert(stack, node->address[i], pad);
+			ptr = node->address[i] + pad;
+			goto RETURN;
+		}
 	}
+	else
+		index_delete(stack, node->address[i], node->available[i]);
 	/* if(node->available[i] == size) */
 DEBUG;
 	old_available = node->available[i];
@@ -1344,59 +2085,76 @@ DEBUG;
 	ptr = node->address[i];
 	goto RETURN;
 LEAF_SEARCH:
-	if((end = leaf_search_available(leaf, size, &left_available, &begin, &address, &available)))
+	path_set(stack, fit ? fit : leaf->address);
+	if(fit)
+	{
+		if((end = leaf_search_address(leaf, fit, NULL, &begin, &address, &available)))
+		{
+			if(!(end[-1] & AVAILABLE) || available < pad + size)
+				GOTO_ERROR;
+		}
+	}
+	else
+		end = leaf_search_available(leaf, size, NULL, &begin, &address, &available);
+	if(end)
 	{		
-		if(size == available)
+		if(!pad && size == available)
 		{
+			index_delete(stack, address, available);
 			end[-1] &= ~AVAILABLE;	
+			summary_drop(leaf, begin, end, 0);
 			if(stack[LEAF].available == available)
 			{
-				stack[LEAF].available = leaf_available(end, leaf->size - (end - leaf->available));
-				if(stack[LEAF].available < left_available)
-					stack[LEAF].available = left_available;
+				stack[LEAF].available = leaf_max(leaf);
 				available_decrease(stack, LEAF - 1);
 			}
 			ptr = address;
 		}
 		else
-		if(size < available)
 		{
 			unsigned char* tmp_begin;
 			unsigned char* tmp_middle;
 			unsigned char* tmp_end;
+			unsigned long tail = available - pad - size;
 			tmp_begin = tmp;
-			tmp_middle = leaf_append(tmp_begin, size);
-			tmp_end = leaf_append(tmp_middle, available - size);
-			tmp_end[-1] |= AVAILABLE;
+			tmp_middle = tmp_begin;
+			if(pad)
+			{
+				tmp_middle = leaf_append(tmp_middle, pad);
+				tmp_middle[-1] |= AVAILABLE;
+			}
+			tmp_middle = tmp_end = leaf_append(tmp_middle, size);
+			if(tail)
+			{
+				tmp_end = leaf_append(tmp_middle, tail);
+				tmp_end[-1] |= AVAILABLE;
+			}
 			if(leaf->size - (end - begin) + (tmp_end - tmp_begin) <= LEAF_SIZE)
 			{
+				index_delete(stack, address, available);
 				end = leaf_update(leaf, begin, end, tmp_begin, tmp_end);
+				if(pad)
+					index_insert(stack, address, pad);
+				if(tail)
+					index_insert(stack, address + pad + size, tail);
 				tmp_middle = end - (tmp_end - tmp_middle);
 				if(stack[LEAF].available == available)
 				{
-					stack[LEAF].available = leaf_available(tmp_middle, leaf->size - (tmp_middle - leaf->available));
-					if(stack[LEAF].available < left_available)
-						stack[LEAF].available = left_available;
+					stack[LEAF].available = leaf_max(leaf);
 					available_decrease(stack, LEAF - 1);
 				}
-				ptr = address;			
-			/* BRK */
-				tmp_end = leaf_next(tmp_middle, &available);
-				if((tmp_end == (leaf->available + (int)leaf->size)))
+				ptr = address + pad;
+			/* BRK: the rest goes back when it is the top of the heap */
+				if(tail && end == leaf->available + (int)leaf->size && ROOT_OF(stack)->trim <= tail && heap_sbrk(stack) == address + available)
 				{
-					if(btff->sbrk(0) == address + available)
+					index_delete(stack, address + pad + size, tail);
+					if(-1 == heap_brk(stack, address + pad + size))
+						GOTO_ERROR;
+					leaf_update(leaf, tmp_middle, end, NULL, NULL);
+					if(stack[LEAF].available == tail)
 					{
-						if(!(tmp_end[1] & AVAILABLE))
-							GOTO_ERROR;
-						if(-1 == brk(address))
-							GOTO_ERROR;
-						leaf_update(leaf, tmp_middle, tmp_end, NULL, NULL);	
-						if(stack[LEAF].available == available)
-						{
-							if(stack[LEAF].available < left_available)
-								stack[LEAF].available = left_available;
-							available_decrease(stack, LEAF - 1);
-						}
+						stack[LEAF].available = leaf_max(leaf);
+						available_decrease(stack, LEAF - 1);
 					}
 				}
 			}
@@ -1421,7 +2179,37 @@ ERROR:
 	return NULL;
 }
 
-static void btff_free(struct stack* stack, void *ptr)
+static void quick_free(struct stack* stack, void *ptr)
+{
+	SETTLE(stack);
+	tree_free(stack, ptr, 1);
+}
+
+/* the caller vouches for the size, as sized delete does, so a small block
+   goes on its quick list without searching the tree */
+static void sized_free(struct stack* stack, void *ptr, size_t size)
+{
+	while(size & (ALIGNMENT - 1))
+		size++;
+	if(0 < size && size <= QUICK_MAX)
+		quick_push(stack, ptr, size);
+	else
+		quick_free(stack, ptr);
+}
+
+/* a batch given out by the spill hook goes back into the tree */
+static void batch_free(struct stack* stack, void* list)
+{
+	struct list* next;
+	SETTLE(stack);
+	for( ; list; list = next)
+	{
+		next = ((struct list*)list)->next;
+		tree_free(stack, list, 0);
+	}
+}
+
+static void tree_free(struct stack* stack, void *ptr, unsigned quick)
 {
 	int level;
 	struct node* node;
@@ -1440,6 +2228,11 @@ static void btff_free(struct stack* stack, void *ptr)
 	int right_level;
 	unsigned long left_available;
 	unsigned leaf_brk;
+	if((leaf = path_search(stack, ptr)))
+	{
+		level = LEAF;
+		GOTO_LEAF_SEARCH;
+	}
 	level = ROOT;
 /* COALESCE: */
 	if(LEAF > (level = node_search_address(stack, level, ptr, NULL, &m)))
@@ -1460,24 +2253,31 @@ DEBUG;
 	if((leaf = right_leaf(stack, middle_level, NULL, &m)))
 	{
 		ptr_end = leaf->address;
+		if(quick && ptr_end - ptr <= QUICK_MAX)
+		{
+			quick_push(stack, ptr, ptr_end - ptr);
+			goto RETURN;
+		}
 		right = leaf->available;
 		end = leaf_next(right, &available);
 		if(end[-1] & AVAILABLE)
 		{
 		DEBUG;
+			index_delete(stack, ptr_end, available);
 			leaf->address = (ptr_end += available);
 
 			leaf_update(leaf, right, end, NULL, NULL);
 			if(stack[LEAF].available == available)
 			{
 			DEBUG;
-				stack[LEAF].available = leaf_available(leaf->available, leaf->size);
+				stack[LEAF].available = leaf_max(leaf);
 				available_decrease(stack, LEAF - 1);
 			}
 			if(leaf->size <= LEAF_MIDDLE)
 			{
 			DEBUG;
-				if((level = rebalance(stack, LEAF)) <= middle_level)
+				/* a root collapse takes middle_level with it */
+				if((level = rebalance(stack, LEAF)) <= middle_level || middle_level < ROOT)
 				{
 					if(LEAF > (level = node_search_address(stack, level, ptr, NULL, &m)))
 					{
@@ -1510,6 +2310,7 @@ DEBUG;
 		if(end[-1] & AVAILABLE)
 		{
 		DEBUG;
+			index_delete(stack, address, available);
 			node->address[m] = ptr = address;
 
 			leaf_update(leaf, left, end, NULL, NULL);
@@ -1522,7 +2323,8 @@ DEBUG;
 			if(leaf->size <= LEAF_MIDDLE)
 			{
 			DEBUG;
-				if((level = rebalance(stack, LEAF)) <= middle_level)
+				/* a root collapse takes middle_level with it */
+				if((level = rebalance(stack, LEAF)) <= middle_level || middle_level < ROOT)
 				{	
 					if(LEAF > (level = node_search_address(stack, level, ptr, NULL, &m)))
 					{
@@ -1548,17 +2350,25 @@ DEBUG;
 	if(0 < node->available[m])
 		GOTO_ERROR;
 	node->available[m] = ptr_end - ptr;
+	index_insert(stack, ptr, node->available[m]);
 	if(stack[middle_level].available < node->available[m])
 	{
 		stack[middle_level].available = node->available[m];
 		available_increase(stack, middle_level - 1);
 	}
+	index_release(stack, ptr, node->available[m]);
 	goto RETURN;
 LEAF_SEARCH:
+	path_set(stack, ptr);
 	if(!(right = leaf_search_address(leaf, ptr, &left, &middle, &address, &available)))
 		GOTO_ERROR;
 	if(right[-1] & AVAILABLE)
 		GOTO_ERROR;
+	if(quick && available <= QUICK_MAX)
+	{
+		quick_push(stack, ptr, available);
+		goto RETURN;
+	}
 /* LEAF_FOUND: */
 	ptr_end = ptr + available;
 	left_level = right_level = -1;
@@ -1574,6 +2384,10 @@ LEAF_SEARCH:
 		DEBUG;
 			if(stack[LEAF].available == available)
 				decrease = 1;
+			/* the top run kept below the trim size may reach it now */
+			if(end == leaf->available + (int)leaf->size && ptr_end + available == heap_sbrk(stack))
+				leaf_brk = 1;
+			index_delete(stack, ptr_end, available);
 			ptr_end += available;
 			tmp_end = leaf_append(tmp_begin, ptr_end - ptr);
 			right = leaf_update(leaf, middle, end, tmp_begin, tmp_end);
@@ -1601,6 +2415,7 @@ LEAF_SEARCH:
 			if(stack[LEAF].available == available)
 				decrease = 1;
 			ptr -= available;
+			index_delete(stack, ptr, available);
 			tmp_end = leaf_append(tmp_begin, ptr_end - ptr);
 			right = leaf_update(leaf, left, right, tmp_begin, tmp_end);
 			middle = left;
@@ -1623,13 +2438,15 @@ LEAF_SEARCH:
 		if(decrease)
 		{
 		DEBUG;
-			stack[LEAF].available = leaf_available(leaf->available, leaf->size);
+			stack[LEAF].available = leaf_max(leaf);
 			available_decrease(stack, LEAF - 1);
 		}
 		node = stack[right_level].node;
 		ptr_end = node->address[r] + node->available[r];
+		index_delete(stack, node->address[r], node->available[r]);
 		node->address[r] = ptr;
 		node->available[r] = ptr_end - ptr;
+		index_insert(stack, ptr, node->available[r]);
 		if(stack[right_level].available < node->available[r])
 		{
 		DEBUG;
@@ -1647,12 +2464,14 @@ LEAF_SEARCH:
 		if(decrease)
 		{
 		DEBUG;
-			stack[LEAF].available = leaf_available(leaf->available, leaf->size);
+			stack[LEAF].available = leaf_max(leaf);
 			available_decrease(stack, LEAF - 1);
 		}
 		node = stack[left_level].node;
 		ptr = node->address[l];
+		index_delete(stack, ptr, node->available[l]);
 		node->available[l] = ptr_end - ptr;
+		index_insert(stack, ptr, node->available[l]);
 		if(stack[left_level].available < node->available[l])
 		{
 		DEBUG;
@@ -1664,7 +2483,9 @@ LEAF_SEARCH:
 	{
 	DEBUG;
 		right[-1] |= AVAILABLE;
+		summary_add(leaf, middle, right);
 		available = ptr_end - ptr;
+		index_insert(stack, ptr, available);
 		if(stack[LEAF].available < available)
 		{
 		DEBUG;
@@ -1672,7 +2493,7 @@ LEAF_SEARCH:
 			available_increase(stack, LEAF - 1);
 		}
 	}
-	if(leaf_brk)
+	if(leaf_brk && leaf->size)
 	{
 		right = leaf->available + leaf->size;
 		if(right[-1] & AVAILABLE)
@@ -1682,16 +2503,22 @@ LEAF_SEARCH:
 				GOTO_ERROR;
 			if(address + available != ptr_end)
 				GOTO_ERROR;
-			if(-1 == btff->brk(ptr))
-				GOTO_ERROR;
-			leaf_update(leaf, middle, right, NULL, NULL);
-			if(stack[LEAF].available == available)
+			if(ROOT_OF(stack)->trim <= available)
 			{
-				stack[LEAF].available = left_available;
-				available_decrease(stack, LEAF - 1);
+				index_delete(stack, address, available);
+				if(-1 == heap_brk(stack, ptr))
+					GOTO_ERROR;
+				leaf_update(leaf, middle, right, NULL, NULL);
+				if(stack[LEAF].available == available)
+				{
+					stack[LEAF].available = left_available;
+					available_decrease(stack, LEAF - 1);
+				}
+				ptr_end = ptr;
 			}
 		}
 	}
+	index_release(stack, ptr, ptr_end - ptr);
 	if(leaf->size <= LEAF_MIDDLE)
 		level = rebalance(stack, LEAF);
 RETURN:
@@ -1704,7 +2531,14 @@ ERROR:
 	return;
 }
 
-static void *btff_realloc(struct stack* stack, void *old, size_t* old_size, size_t new_size)
+static void *tree_realloc(struct stack* stack, void *old, size_t* old_size, size_t new_size)
+{
+	return tree_resize(stack, old, old_size, new_size, 1);
+}
+
+/* without move, a block that does not fit where it is stays there,
+   NULL comes back and old_size holds what it still has */
+static void *tree_resize(struct stack* stack, void *old, size_t* old_size, size_t new_size, int move)
 {
 	void* old_end;
 	void* new;
@@ -1715,15 +2549,22 @@ static void *btff_realloc(struct stack* stack, void *old, size_t* old_size, size
 	struct leaf* leaf;
 	unsigned char* middle, * right, * end;
 	unsigned long available;
+	unsigned long merged;
 	int middle_level, right_level;
 	int delta;
 	unsigned char tmp_begin[12];
 	unsigned char* tmp_middle;
 	unsigned char* tmp_end;
+	SETTLE(stack);
 	while(new_size & (ALIGNMENT - 1))
 		new_size++;
-	level = ROOT;
 	split = NULL;
+	if((leaf = path_search(stack, old)))
+	{
+		level = LEAF;
+		GOTO_LEAF_SEARCH;
+	}
+	level = ROOT;
 NODE_SEARCH:
 	if(LEAF > (level = node_search_address(stack, level, old, split, &m)))
 		middle_level = level;
@@ -1765,11 +2606,13 @@ NODE_SEARCH:
 		}
 		leaf->address -= delta;
 		leaf_update(leaf, leaf->available, leaf->available, tmp_begin, tmp_end);
+		index_insert(stack, leaf->address, delta);
 		if(stack[LEAF].available < delta)
 		{
 			stack[LEAF].available = delta;
 			available_increase(stack, LEAF - 1);
 		}
+		*old_size = new_size;
 		return old;
 	}
 	else
@@ -1783,6 +2626,7 @@ NODE_SEARCH:
 		end = leaf_next(begin, &available);
 		if((end[-1] & AVAILABLE) && (delta <= available))
 		{
+			index_delete(stack, old_end, available);
 			if(delta < available)
 			{
 				unsigned char tmp_begin[12];
@@ -1790,13 +2634,14 @@ NODE_SEARCH:
 				tmp_end = leaf_append(tmp_begin, available - delta);
 				tmp_end[-1] |= AVAILABLE;
 				leaf_update(leaf, begin, end, tmp_begin, tmp_end);
+				index_insert(stack, old_end + delta, available - delta);
 			}
 			else
 				leaf_update(leaf, begin, end, NULL, NULL);
 			leaf->address += delta;
 			if(stack[LEAF].available == available)
 			{
-				stack[LEAF].available = leaf_available(leaf->available, leaf->size);
+				stack[LEAF].available = leaf_max(leaf);
 				available_decrease(stack, LEAF - 1);
 			}
 			goto OLD;
@@ -1805,14 +2650,19 @@ NODE_SEARCH:
 			goto NEW;
 	}
 	else
+	{
+		*old_size = new_size;
 		return old;
+	}
 LEAF_SEARCH:
+	path_set(stack, old);
 	if(!(right = leaf_search_address(leaf, old, NULL, &middle, NULL, &available)))
 		GOTO_ERROR;
 	if(right[-1] & AVAILABLE)
 		GOTO_ERROR;
 	old_end = old + available;
 	right_level = -1;
+	merged = 0;
 	tmp_end = tmp_middle = tmp_begin;
 	if(new_size < old_end - old)
 	{
@@ -1825,6 +2675,7 @@ LEAF_SEARCH:
 				tmp_middle = leaf_append(tmp_begin, new_size);
 				tmp_end = leaf_append(tmp_middle, delta + available);
 				delta += available;
+				merged = available;
 				right = end;
 			}
 			else
@@ -1847,8 +2698,10 @@ LEAF_SEARCH:
 			else
 			{
 				tmp_end = leaf_append(tmp_begin, new_size);
+				index_delete(stack, node->address[r], node->available[r]);
 				node->address[r] -= delta;
 				node->available[r] += delta;
+				index_insert(stack, node->address[r], node->available[r]);
 				if(stack[right_level].available < node->available[r])
 				{
 					stack[right_level].available = node->available[r];
@@ -1859,7 +2712,7 @@ LEAF_SEARCH:
 		}
 		else /* BRK */
 		{
-			if(-1 == btff->brk(old + new_size))
+			if(-1 == heap_brk(stack, old + new_size))
 				GOTO_ERROR;
 			tmp_end = leaf_append(tmp_begin, new_size);
 			delta = 0;
@@ -1871,7 +2724,11 @@ LEAF_SEARCH:
 			split = node_split;
 			goto NODE_SEARCH;
 		}
+		if(merged)
+			index_delete(stack, old_end, merged);
 		leaf_update(leaf, middle, right, tmp_begin, tmp_end);
+		if(0 < delta)
+			index_insert(stack, old + new_size, delta);
 		if(stack[LEAF].available < delta)
 		{
 			stack[LEAF].available = delta;
@@ -1899,6 +2756,7 @@ LEAF_SEARCH:
 				}
 				else
 					tmp_end = tmp_middle;
+				merged = available;
 				right = end;
 				if(stack[LEAF].available == available)
 					decrease = 1;
@@ -1923,9 +2781,11 @@ LEAF_SEARCH:
 					split = node_split;
 					goto NODE_SEARCH;
 				}
+				index_delete(stack, node->address[r], node->available[r]);
 				node->address[r] += delta;
 				available = node->available[r];
 				node->available[r] -= delta;
+				index_insert(stack, node->address[r], node->available[r]);
 				if(stack[right_level].available == available)
 				{
 					stack[right_level].available = node_available(node->available, node->size);
@@ -1934,6 +2794,7 @@ LEAF_SEARCH:
 			}
 			else
 			{
+				index_delete(stack, node->address[r], node->available[r]);
 				node->address[r] -= old_end - old;
 				available = node->available[r];
 				node->available[r] = 0;
@@ -1948,8 +2809,8 @@ LEAF_SEARCH:
 		}
 		else /* BRK */
 		{
-			if(-1 == btff->brk(old + new_size))
-				GOTO_ERROR;
+			if(-1 == heap_brk(stack, old + new_size))
+				goto NEW;
 			tmp_end = leaf_append(tmp_begin, new_size);
 		}
 		if(LEAF_SIZE < leaf->size - (right - middle) + (tmp_end - tmp_begin))
@@ -1959,10 +2820,14 @@ LEAF_SEARCH:
 			split = node_split;
 			goto NODE_SEARCH;
 		}
+		if(merged)
+			index_delete(stack, old_end, merged);
 		leaf_update(leaf, middle, right, tmp_begin, tmp_end);
+		if(delta < merged)
+			index_insert(stack, old_end + delta, merged - delta);
 		if(decrease)
 		{
-			stack[LEAF].available = leaf_available(leaf->available, leaf->size);
+			stack[LEAF].available = leaf_max(leaf);
 			available_decrease(stack, LEAF - 1);
 		}
 	}
@@ -1971,10 +2836,16 @@ OLD:
 		rebalance(stack, LEAF);
 	*old_size = new_size;
 	return old;
-NEW:		
-	btff_free(stack, old);
-	new = btff_malloc(stack, new_size);
+NEW:
+	/* the free runs carry index entries, so the old block is copied before it is released */
 	*old_size = old_end - old;
+	if(!move)
+		return NULL;
+	if((new = tree_malloc(stack, new_size)))
+	{
+		btff_memcpy(new, old, *old_size);
+		quick_free(stack, old);
+	}
 	return new;
 ERROR:
 	btff_perror(__FUNCTION__);
@@ -1983,6 +2854,467 @@ ERROR:
 	return NULL;
 }
 
+/*----------------------------------------------------------------------------*/
+/* lookup without the heap lock: the version read is rechecked before each
+   pointer read under it is followed. tree cells are never unmapped, so a
+   stale cell reads as garbage at worst and the caller comes back on STALE. */
+
+#define SEEN(root, version) (__atomic_thread_fence(__ATOMIC_ACQUIRE), (version) == __atomic_load_n(&(root)->version, __ATOMIC_RELAXED))
+
+static size_t usable_size(struct btff_heap* root, void* ptr, unsigned long version)
+{
+	struct node* node;
+	struct leaf leaf;
+	void* child;
+	void* address;
+	unsigned char* right;
+	unsigned long available;
+	int level;
+	int size;
+	int i;
+	child = root->node;
+	if(!SEEN(root, version))
+		return STALE;
+	if(!child)
+		return 0;
+	for(level = LEVEL(child); level < LEAF; level++)
+	{
+		node = child;
+		size = node->size;
+		if(size < 1 || NODE_SIZE < size)
+			return SEEN(root, version) ? 0 : STALE;
+		for(i = 1; i < size && node->address[i] < ptr; i += 2);
+		if(i < size && ptr == node->address[i])
+		{
+			/* a separator run ends where the far left leaf on its right begins */
+			if(0 < node->available[i] || size <= i + 1)
+				return SEEN(root, version) ? 0 : STALE;
+			for(child = node->address[i + 1], level++; ; level++)
+			{
+				if(!SEEN(root, version))
+					return STALE;
+				if(LEAF <= level)
+					break;
+				child = ((struct node*)child)->address[0];
+			}
+			address = ((struct leaf*)child)->address;
+			if(!SEEN(root, version))
+				return STALE;
+			return address - ptr;
+		}
+		child = node->address[i - 1];
+		if(!SEEN(root, version))
+			return STALE;
+	}
+	leaf = *(struct leaf*)child;
+	if(!SEEN(root, version))
+		return STALE;
+	if(leaf.size < 0 || LEAF_SIZE < leaf.size)
+		return 0;
+	if(!(right = leaf_search_address(&leaf, ptr, NULL, NULL, NULL, &available)) || (right[-1] & AVAILABLE))
+		return 0;
+	return available;
+}
+
+/*----------------------------------------------------------------------------*/
+/* rebuild: the runs are read off the tree in order and packed into leaves
+   filled to a target, three children to a node, in a scratch block of cells
+   laid out breadth first from the root. the first pass only counts the
+   leaves, which fixes the shape, the second fills the block. the old cells
+   go back to the free list and the block is moved into cells taken from it,
+   so rebuilding the same tree again takes no new pages. */
+
+struct build
+{
+	char* cells;
+	int target;
+	int level;
+	long count[STACK];
+	long offset[STACK];
+	long index[STACK];
+	int children[STACK];
+	int used;
+	struct leaf* leaf;
+	struct leaf scratch;
+	void* root;
+	unsigned long max;
+	void* address;
+	unsigned long size;
+	int available;
+};
+
+#define build_cell(build, level) ((void*)((build)->cells + ((build)->offset[level] + (build)->index[level]) * CELL_SIZE))
+
+/* the last node of a level takes two children when three do not come out even */
+static int build_group(struct build* build, int level)
+{
+	long children = build->count[level + 1];
+	long last = build->count[level] - 1;
+	if(children % 3 == 2 && build->index[level] == last)
+		return 2;
+	if(children % 3 == 1 && last - 1 <= build->index[level])
+		return 2;
+	return 3;
+}
+
+static void build_child(struct build* build, int level, void* child, unsigned long max)
+{
+	struct node* node;
+	if(level == build->level)
+	{
+		build->root = child;
+		build->max = max;
+		return;
+	}
+	level--;
+	node = build_cell(build, level);
+	if(!build->children[level])
+	{
+		node->level = level;
+		node->size = 0;
+	}
+	node->address[node->size] = child;
+	node->available[node->size++] = max;
+	if(++build->children[level] == build_group(build, level))
+	{
+		build->children[level] = 0;
+		build->index[level]++;
+		build_child(build, level, node, node_available(node->available, node->size));
+	}
+}
+
+/* a separator goes to the lowest node still open above its level */
+static void build_separator(struct build* build, int level, void* address, unsigned long available)
+{
+	struct node* node;
+	for(level--; !build->children[level]; level--);
+	node = build_cell(build, level);
+	node->address[node->size] = address;
+	node->available[node->size++] = available;
+}
+
+static void build_leaf(struct build* build)
+{
+	if(!build->leaf)
+		return;
+	if(build->cells)
+		build_child(build, LEAF, build->leaf, leaf_max(build->leaf));
+	build->index[LEAF]++;
+	build->leaf = NULL;
+}
+
+/* a run that does not fit the target goes up as a separator, unless it is the last */
+static void build_run(struct build* build, int more)
+{
+	unsigned char tmp[12];
+	unsigned char* end;
+	if(build->leaf && build->target < build->used + (leaf_append(tmp, build->size) - tmp) && more)
+	{
+		build_leaf(build);
+		if(build->cells)
+			build_separator(build, LEAF, build->address, build->available ? build->size : 0);
+		return;
+	}
+	if(!build->leaf)
+	{
+		build->leaf = build->cells ? build_cell(build, LEAF) : &build->scratch;
+		build->leaf->address = build->address;
+		build->leaf->size = 0;
+		summary_reset(build->leaf);
+		build->used = 0;
+	}
+	end = leaf_append(build->leaf->available + build->used, build->size);
+	if(build->available)
+		end[-1] |= AVAILABLE;
+	build->used = build->leaf->size = end - build->leaf->available;
+}
+
+/* one run behind the walk: an allocated separator carries no size, its end
+   is where the next run begins */
+static void build_emit(struct build* build, void* address, unsigned long size, int available)
+{
+	if(build->address)
+	{
+		if(!build->size)
+			build->size = address - build->address;
+		build_run(build, 1);
+	}
+	build->address = address;
+	build->size = size;
+	build->available = available;
+}
+
+static void build_walk(struct build* build, void* p, int level)
+{
+	struct node* node;
+	struct leaf* leaf;
+	unsigned char* begin;
+	unsigned char* end;
+	void* address;
+	unsigned long size;
+	int i;
+	if(LEAF == level)
+	{
+		leaf = p;
+		for(begin = leaf->available, address = leaf->address; begin < leaf->available + (int)leaf->size; begin = end, address += size)
+		{
+			end = leaf_next(begin, &size);
+			build_emit(build, address, size, end[-1] & AVAILABLE);
+		}
+		return;
+	}
+	node = p;
+	for(i = 0; i < node->size; i++)
+		if(i & 1)
+			build_emit(build, node->address[i], node->available[i], 0 < node->available[i]);
+		else
+			build_walk(build, node->address[i], level + 1);
+}
+
+static void build_pass(struct build* build, void* root)
+{
+	int level;
+	for(level = 0; level < STACK; level++)
+		build->index[level] = build->children[level] = 0;
+	build->leaf = NULL;
+	build->address = NULL;
+	build_walk(build, root, LEVEL(root));
+	build_run(build, 0);
+	build_leaf(build);
+}
+
+static void build_delete(struct stack* stack, void* p, int level)
+{
+	struct node* node = p;
+	int i;
+	if(level < LEAF)
+		for(i = 0; i < node->size; i += 2)
+			build_delete(stack, node->address[i], level + 1);
+	delete64byte(stack, p);
+}
+
+static void build_move(struct stack* stack, struct build* build, void** cell, long total)
+{
+	struct node* node;
+	long i;
+	int j;
+	for(i = 0; i < total; i++)
+		cell[i] = new64byte(stack);
+	for(i = 0; i < total; i++)
+	{
+		btff_memcpy(cell[i], build->cells + i * CELL_SIZE, CELL_SIZE);
+		if(build->offset[LEAF] <= i)
+			continue;
+		node = cell[i];
+		for(j = 0; j < node->size; j += 2)
+			node->address[j] = cell[((char*)node->address[j] - build->cells) / CELL_SIZE];
+	}
+	build->root = cell[((char*)build->root - build->cells) / CELL_SIZE];
+}
+
+static int rebuild(struct stack* stack, int fill)
+{
+	static long page = 0;
+	struct build build;
+	void* old = ROOT_OF(stack)->node;
+	long total;
+	long size;
+	int level;
+	if(!old)
+		return 0;
+	if(!page)
+		page = sysconf(_SC_PAGESIZE);
+	build.target = LEAF_SIZE * fill / 100;
+	if(LEAF_SIZE - 12 < build.target)
+		build.target = LEAF_SIZE - 12;
+	build.cells = NULL;
+	build_pass(&build, old);
+	build.count[LEAF] = build.index[LEAF];
+	for(level = LEAF; 1 < build.count[level]; level--)
+		build.count[level - 1] = (build.count[level] + 2) / 3;
+	build.level = level;
+	for(total = 0; level <= LEAF; level++)
+	{
+		build.offset[level] = total;
+		total += build.count[level];
+	}
+	size = (total * (CELL_SIZE + sizeof(void*)) + page - 1) & ~(page - 1);
+	if(MAP_FAILED == (build.cells = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)))
+		return ENOMEM;
+	build_pass(&build, old);
+	build_delete(stack, old, LEVEL(old));
+	build_move(stack, &build, (void**)(build.cells + total * CELL_SIZE), total);
+	munmap(build.cells, size);
+	ROOT_OF(stack)->node = build.root;
+	ROOT_OF(stack)->finger = 0;
+	ROOT_OF(stack)->deferred = 0;
+	stack[ROOT].node = build.root;
+	stack[ROOT].available = build.max;
+	return 0;
+}
+
+/* totals over every run in the tree, for the stats page. an allocated
+   separator runs up to the far left leaf on its right. */
+static void census_walk(void* p, int level, unsigned long* r_size, unsigned long* r_free, unsigned long* r_runs)
+{
+	struct node* node;
+	struct leaf* leaf;
+	unsigned char* begin;
+	unsigned char* end;
+	unsigned long size;
+	void* right;
+	int i, j;
+	if(LEAF == level)
+	{
+		leaf = p;
+		for(begin = leaf->available; begin < leaf->available + (int)leaf->size; begin = end)
+		{
+			end = leaf_next(begin, &size);
+			*r_size += size;
+			if(end[-1] & AVAILABLE)
+			{
+				*r_free += size;
+				(*r_runs)++;
+			}
+		}
+		return;
+	}
+	node = p;
+	for(i = 0; i < node->size; i++)
+		if(!(i & 1))
+			census_walk(node->address[i], level + 1, r_size, r_free, r_runs);
+		else
+		if(0 < node->available[i])
+		{
+			*r_size += node->available[i];
+			*r_free += node->available[i];
+			(*r_runs)++;
+		}
+		else
+		{
+			for(right = node->address[i + 1], j = level + 1; j < LEAF; j++)
+				right = ((struct node*)right)->address[0];
+			*r_size += ((struct leaf*)right)->address - node->address[i];
+		}
+}
+
+static void census(struct stack* stack, unsigned long* r_size, unsigned long* r_free, unsigned long* r_runs)
+{
+	*r_size = *r_free = *r_runs = 0;
+	if(ROOT_OF(stack)->node)
+		census_walk(ROOT_OF(stack)->node, ROOT, r_size, r_free, r_runs);
+}
+
+/* after a lock holder died mid operation: nothing derived from the tree is
+   trusted. the nodes and leaves are checked without exiting, the top comes
+   back to where the runs end, the tree is rebuilt and the index refilled
+   from its free runs. the cell free list, the quick lists and the radix
+   tables may be half written, they are given up. */
+static inline int recover_cell(struct btff_heap* root, void* p)
+{
+	return p && (!root->pool || (root->pool <= p && p + CELL_SIZE <= root->end));
+}
+
+static int recover_walk(struct btff_heap* root, void* p, int level, void* begin, void* end, void** r_end)
+{
+	struct node* node;
+	struct leaf* leaf;
+	unsigned char* run;
+	unsigned char* next;
+	unsigned long size;
+	void* address;
+	int i;
+	if(!recover_cell(root, p))
+		return 0;
+	if(LEAF == level)
+	{
+		leaf = p;
+		if(leaf->size < 0 || LEAF_SIZE < leaf->size || leaf->address < begin)
+			return 0;
+		for(run = leaf->available, address = leaf->address; run < leaf->available + (int)leaf->size; run = next, address += size)
+			if(leaf->available + (int)leaf->size < (next = leaf_next(run, &size)) || !size)
+				return 0;
+		if(end && address != end)
+			return 0;
+		*r_end = address;
+		return 1;
+	}
+	node = p;
+	if(node->level != level || node->size < 1 || NODE_SIZE < node->size || !(node->size & 1))
+		return 0;
+	for(i = 1; i < node->size; i += 2)
+		if(node->address[i] < begin || (i + 2 < node->size && node->address[i + 2] <= node->address[i]) || (end && end <= node->address[i]))
+			return 0;
+	for(i = 0; i < node->size; i += 2)
+		if(!recover_walk(root, node->address[i], level + 1, i ? node->address[i - 1] + node->available[i - 1] : begin, i + 1 < node->size ? node->address[i + 1] : end, r_end))
+			return 0;
+	return 1;
+}
+
+static void recover_index(struct stack* stack, void* p, int level)
+{
+	struct node* node;
+	struct leaf* leaf;
+	unsigned char* begin;
+	unsigned char* end;
+	unsigned long size;
+	void* address;
+	int i;
+	if(LEAF == level)
+	{
+		leaf = p;
+		for(begin = leaf->available, address = leaf->address; begin < leaf->available + (int)leaf->size; begin = end, address += size)
+			if((end = leaf_next(begin, &size))[-1] & AVAILABLE)
+				index_insert(stack, address, size);
+		return;
+	}
+	node = p;
+	for(i = 0; i < node->size; i++)
+		if(!(i & 1))
+			recover_index(stack, node->address[i], level + 1);
+		else
+		if(0 < node->available[i])
+			index_insert(stack, node->address[i], node->available[i]);
+}
+
+static int recover(struct stack* stack)
+{
+	struct btff_heap* root = ROOT_OF(stack);
+	void* top = NULL;
+	int error;
+	int i;
+	if(root->node && (!recover_cell(root, root->node) || !recover_walk(root, root->node, LEVEL(root->node), root->begin, NULL, &top)))
+		return EINVAL;
+	root->list = stack[LIST].node = NULL;
+	root->radix = NULL;
+	root->finger = 0;
+	root->deferred = 0;
+	root->purge = NULL;
+	root->bitmap = 0;
+	for(i = 0; i < INDEX_SIZE; i++)
+		root->index[i] = NULL;
+	root->quick_total = 0;
+	for(i = 0; i < QUICK_SIZE; i++)
+	{
+		root->quick[i] = NULL;
+		root->quick_size[i] = 0;
+	}
+	root->heap_size = root->free_size = root->free_runs = 0;
+	if(!root->node)
+		return 0;
+	if(heap_sbrk(stack) < top)
+		return EINVAL;
+	if(top < heap_sbrk(stack) && -1 == heap_brk(stack, top))
+		return EINVAL;
+	stack[ROOT].node = root->node;
+	if((error = rebuild(stack, REBUILD_FILL)))
+		return error;
+	census(stack, &root->heap_size, &root->free_size, &root->free_runs);
+	root->free_size = root->free_runs = 0;
+	recover_index(stack, root->node, ROOT);
+	return 0;
+}
+
 static void available_check(void* root, int level)
 {
 	struct node* node = root;
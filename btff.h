@@ -33,64 +33,92 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef __btff_h__
 #define __btff_h__ __btff_h__
 
-#include <pthread.h>
 #include <stdlib.h>
 
-struct root
-{
-	pthread_mutex_t mutex;
-	unsigned long available;
-	void* node;
-	void* list;
-};
-
-enum { LEAF = 30, LIST, STACK };
-
-#define LEVEL(p) ((int)((p) ? (((unsigned long)((struct node*)(p))->level) < LEAF ? ((struct node*)(p))->level : LEAF) : LEAF))
-#define ROOT (btff->root ? LEVEL(btff->root->node) : LEAF) 
-
-struct stack
-{
-    unsigned long available;
-    void* node;
-    int child;
-};
-
-struct btff
-{
-	struct root* root;
-	void * (*memmove)(register void *dst, register void *src, register int len);
-	int (*brk)(void *addr);
-	void* (*sbrk)(intptr_t increment);
-    void* (*malloc)(struct stack* stack, size_t size);
-    void (*free)(struct stack* stack, void *ptr);
-    void* (*realloc)(struct stack* stack, void *ptr, size_t* old_size, size_t size);
-	void* (*memalign)(struct stack* stack, size_t alignment, size_t size);
-	void (*sanity_check)(void* p, int level, void* address_end);
-	void (*available_check)(void* root, int level);
-};
-
-#define NODE_SIZE 7
-#define NODE_MIDDLE (NODE_SIZE / 2)
-
-struct node
-{
-    int level;
-    int size;
-    void* address[NODE_SIZE];
-    unsigned long available[NODE_SIZE];
-};
-
-#define LEAF_SIZE (64 - sizeof(void*) - sizeof(char))
-#define LEAF_MIDDLE (LEAF_SIZE / 2)
-#define AVAILABLE 0x01
-#define ALIGNMENT 8
-
-struct leaf
-{
-    void* address;
-    char size;
-    unsigned char available[LEAF_SIZE];
-} __attribute__ ((__packed__));
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a heap and a region are opaque, only their pointers are handed around */
+struct btff_heap;
+struct btff_region;
+
+/* every block is aligned to at least this */
+#define BTFF_MIN_ALIGN 8
+
+/* mallopt parameters of our own, beside M_TRIM_THRESHOLD, M_MMAP_THRESHOLD
+   and M_ARENA_MAX of malloc.h */
+#define M_BTFF_CACHE -101
+#define M_BTFF_DECAY -102
+#define M_BTFF_POLICY -103
+#define M_BTFF_STEPS -104
+#define M_BTFF_TLAB -105
+#define M_BTFF_TRANSFER -106
+
+/* values of M_BTFF_POLICY */
+enum { BTFF_PLACE_INDEX, BTFF_PLACE_FIRST };
+
+void* btff_malloc(size_t size);
+void btff_free(void* ptr);
+void btff_free_sized(void* ptr, size_t size);
+void* btff_realloc(void* ptr, size_t size);
+void* btff_calloc(size_t nmemb, size_t size);
+int btff_posix_memalign(void** memptr, size_t alignment, size_t size);
+void* btff_memalign(size_t alignment, size_t size);
+size_t btff_usable_size(void* ptr);
+
+/* flags of the extended api. the low six bits hold the log2 alignment,
+   an arena is given by index, a region is the one bound to the thread. */
+#define BTFF_LG_ALIGN(lg) ((int)(lg))
+#define BTFF_ALIGN(a) BTFF_LG_ALIGN(__builtin_ctzl(a))
+#define BTFF_ZERO 0x40
+#define BTFF_TCACHE_NONE 0x80
+#define BTFF_INPLACE 0x100
+#define BTFF_REGION 0x200
+#define BTFF_ARENA(i) (((i) + 1) << 12)
+
+void* btff_mallocx(size_t size, int flags);
+void* btff_rallocx(void* ptr, size_t size, int flags);
+size_t btff_xallocx(void* ptr, size_t size, size_t extra, int flags);
+size_t btff_sallocx(void* ptr, int flags);
+void btff_dallocx(void* ptr, int flags);
+
+struct btff_region* btff_region_create(size_t size);
+void* btff_region_alloc(struct btff_region* region, size_t size);
+void btff_region_reset(struct btff_region* region);
+void btff_region_destroy(struct btff_region* region);
+struct btff_region* btff_region_bind(struct btff_region* region);
+
+struct btff_heap* btff_heap_open(const char* path, void* base, size_t size);
+struct btff_heap* btff_heap_share(const char* name, void* base, size_t size);
+struct btff_heap* btff_heap_share_fd(int fd, void* base, size_t size);
+void btff_heap_close(struct btff_heap* heap);
+struct btff_heap* btff_heap_create(size_t size);
+void btff_heap_destroy(struct btff_heap* heap);
+size_t btff_heap_purge(struct btff_heap* heap, unsigned long age);
+int btff_purge_start(unsigned long decay);
+void btff_purge_stop(void);
+int btff_stats_start(unsigned long interval);
+void btff_stats_stop(void);
+int btff_mallopt(int param, int value);
+int btff_options(const char* options);
+int btff_profile_start(size_t rate, const char* path, int signal);
+int btff_profile_dump(const char* path);
+void btff_profile_stop(void);
+void* btff_heap_malloc(struct btff_heap* heap, size_t size);
+void btff_heap_free(struct btff_heap* heap, void* ptr);
+void* btff_heap_realloc(struct btff_heap* heap, void* ptr, size_t size);
+void* btff_heap_memalign(struct btff_heap* heap, size_t alignment, size_t size);
+size_t btff_heap_usable_size(struct btff_heap* heap, void* ptr);
+int btff_heap_depth(struct btff_heap* heap);
+int btff_heap_steps(struct btff_heap* heap, int steps);
+int btff_heap_rebuild(struct btff_heap* heap, int fill);
+
+#define btff_heap_offset(heap, ptr) ((size_t)((char*)(ptr) - (char*)(heap)))
+#define btff_heap_pointer(heap, offset) ((void*)((char*)(heap) + (offset)))
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif/*__btff_h__*/
@@ -0,0 +1,164 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, C++ adaptors */
+#ifndef __btff_hpp__
+#define __btff_hpp__ __btff_hpp__
+
+#include <cstddef>
+#include <new>
+#include <memory_resource>
+#include "btff.h"
+
+namespace btff
+{
+
+/* a btff heap as a memory resource, the process heap when none is given */
+
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+	explicit memory_resource(struct btff_heap* heap = NULL) noexcept : heap(heap) {}
+	struct btff_heap* get_heap() const noexcept { return heap; }
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void* ptr;
+		if(!bytes)
+			bytes = 1;
+		if(alignment <= BTFF_MIN_ALIGN)
+			ptr = btff_heap_malloc(heap, bytes);
+		else
+			ptr = btff_heap_memalign(heap, alignment, bytes);
+		if(!ptr)
+			throw std::bad_alloc();
+		return ptr;
+	}
+
+	void do_deallocate(void* ptr, std::size_t, std::size_t) override
+	{
+		btff_heap_free(heap, ptr);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		const memory_resource* resource = dynamic_cast<const memory_resource*>(&other);
+		return resource && resource->heap == heap;
+	}
+
+private:
+	struct btff_heap* heap;
+};
+
+/* a region as a memory resource: deallocate is a no-op,
+   everything goes at once on release or destruction */
+
+class region_resource : public std::pmr::memory_resource
+{
+public:
+	explicit region_resource(std::size_t size = 64 * 1024) : region(btff_region_create(size))
+	{
+		if(!region)
+			throw std::bad_alloc();
+	}
+	~region_resource() { btff_region_destroy(region); }
+	region_resource(const region_resource&) = delete;
+	region_resource& operator=(const region_resource&) = delete;
+	void release() noexcept { btff_region_reset(region); }
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		unsigned long address;
+		void* ptr;
+		if(!bytes)
+			bytes = 1;
+		if(alignment < BTFF_MIN_ALIGN)
+			alignment = BTFF_MIN_ALIGN;
+		if(!(ptr = btff_region_alloc(region, bytes + alignment - BTFF_MIN_ALIGN)))
+			throw std::bad_alloc();
+		address = ((unsigned long)ptr + alignment - 1) & ~(unsigned long)(alignment - 1);
+		return (void*)address;
+	}
+
+	void do_deallocate(void*, std::size_t, std::size_t) override
+	{
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other;
+	}
+
+private:
+	struct btff_region* region;
+};
+
+/* a standard allocator on a btff heap, the process heap when none is given */
+
+template<class T>
+class allocator
+{
+public:
+	typedef T value_type;
+
+	explicit allocator(struct btff_heap* heap = NULL) noexcept : heap(heap) {}
+	template<class U> allocator(const allocator<U>& other) noexcept : heap(other.heap) {}
+
+	T* allocate(std::size_t n)
+	{
+		void* ptr;
+		if(n > (std::size_t)-1 / sizeof(T))
+			throw std::bad_array_new_length();
+		if(alignof(T) <= BTFF_MIN_ALIGN)
+			ptr = btff_heap_malloc(heap, n ? n * sizeof(T) : 1);
+		else
+			ptr = btff_heap_memalign(heap, alignof(T), n ? n * sizeof(T) : 1);
+		if(!ptr)
+			throw std::bad_alloc();
+		return static_cast<T*>(ptr);
+	}
+
+	void deallocate(T* ptr, std::size_t) noexcept
+	{
+		btff_heap_free(heap, ptr);
+	}
+
+	template<class U> bool operator==(const allocator<U>& other) const noexcept { return heap == other.heap; }
+	template<class U> bool operator!=(const allocator<U>& other) const noexcept { return heap != other.heap; }
+
+	struct btff_heap* heap;
+};
+
+}
+
+#endif/*__btff_hpp__*/
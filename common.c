@@ -3,28 +3,27 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include "btff.h"
 
+/* not malloc and memset here: the compiler folds the pair back into calloc */
 void *calloc(size_t nmemb, size_t size)
 {
-	unsigned long* ptr;
-	if((ptr = malloc(nmemb * size)))
-		return memset(ptr, 0, nmemb * size);
-	return NULL;
+	return btff_calloc(nmemb, size);
 }
 
 int mallopt(int param, int value)
 {
-	return 0;
+	return btff_mallopt(param, value);
 }
 
 int malloc_trim (size_t pad) 
 { 
-	return 1; 
+	return 0 < btff_heap_purge(NULL, 0); 
 }
 
 size_t malloc_usable_size (void *ptr) 
 { 
-	return 0; 
+	return btff_usable_size(ptr); 
 }
 
 void malloc_stats (void) 
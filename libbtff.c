@@ -32,128 +32,2105 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 /* B Tree First Fit Memory Allocator */
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <malloc.h>
 #include <dlfcn.h>
 #include <pthread.h>
-#include "btff.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <execinfo.h>
+#include "btff-internal.h"
 
-static struct root root = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL };
+#ifdef BTFF_STATIC
+/* linked in beside the system malloc: the process heap keeps off the program
+   break and takes a reserved range on first use */
+int btff_core(void **memptr, size_t alignment, size_t size);
+#define posix_memalign btff_core
+static struct btff_heap root = { PTHREAD_MUTEX_INITIALIZER, .cache = QUICK_DEPTH, .provider = PROVIDER_RESERVE };
+#else
+static struct btff_heap root = { PTHREAD_MUTEX_INITIALIZER, 0, NULL, NULL, .cache = QUICK_DEPTH };
+#endif
 static struct btff* btff = NULL;
+/* the handshake hands the table back along with EINVAL, which the compiler's
+   builtin posix_memalign assumes never happens, so it goes through a pointer */
+static int (*volatile handshake)(void **memptr, size_t alignment, size_t size) = posix_memalign;
 
+/* the process heap is split into arenas: the root and, as threads meet on
+   its lock, up to ARENA_SIZE - 1 reserved heaps, each with a tree and lock of
+   its own. a thread keeps to its home arena until it finds that busy and
+   moves on to the next, a block goes back to the arena whose range holds it. */
+
+static struct btff_heap* arena[ARENA_SIZE] = { &root };
+static int arena_count = 1;
+static int arena_max = ARENA_SIZE;
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int arena_home __attribute__((tls_model("initial-exec")));
+static struct btff_heap* tlab_heap;
+static struct stats* stats;
+
+/* op counters are bumped under the heap lock, contention as it is found,
+   and the ops that take no lock count against the thread's home arena */
+#define stats_count(heap, counter) do { if((heap)->stats) __atomic_fetch_add(&(heap)->stats->counter, 1, __ATOMIC_RELAXED); } while(0)
+#define stats_fast(counter) do { struct stats* page = __atomic_load_n(&stats, __ATOMIC_RELAXED); if(page) __atomic_fetch_add(&page->heap[arena_current()].counter, 1, __ATOMIC_RELAXED); } while(0)
+#define stats_contended(heap) do { if((heap)->stats) __atomic_fetch_add(&(heap)->stats->contended, 1, __ATOMIC_RELAXED); } while(0)
+
+static struct btff_heap* arena_get(int i)
+{
+	struct btff_heap* heap;
+	if(i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE))
+		return arena[i];
+	pthread_mutex_lock(&arena_mutex);
+	if(i == arena_count && (heap = btff_heap_create(0)))
+	{
+		heap->steps = root.steps;
+		heap->trim = root.trim;
+		heap->release = root.release;
+		heap->cache = root.cache;
+		heap->policy = root.policy;
+		heap->stats = stats ? &stats->heap[i] : NULL;
+		arena[i] = heap;
+		__atomic_store_n(&arena_count, i + 1, __ATOMIC_RELEASE);
+	}
+	heap = i < arena_count ? arena[i] : &root;
+	pthread_mutex_unlock(&arena_mutex);
+	return heap;
+}
+
+/* a home past a lowered arena_max moves back to the root */
+static inline int arena_current(void)
+{
+	if(__atomic_load_n(&arena_max, __ATOMIC_RELAXED) <= arena_home)
+		arena_home = 0;
+	return arena_home;
+}
+
+static struct btff_heap* arena_lock(void)
+{
+	struct btff_heap* heap = arena[arena_current()];
+	if(!pthread_mutex_trylock(&heap->mutex))
+		return heap;
+	stats_contended(heap);
+	if(ARENA_SIZE > 1)
+	{
+		heap = arena_get(arena_home = (arena_home + 1) % __atomic_load_n(&arena_max, __ATOMIC_RELAXED));
+		if(heap == &root)
+			arena_home = 0;
+	}
+	pthread_mutex_lock(&heap->mutex);
+	return heap;
+}
+
+/* an arena asked for by index is created along with those before it,
+   within the arenas configured */
+static struct btff_heap* arena_select(int i)
+{
+	struct btff_heap* heap = &root;
+	int j;
+	if(i < 0 || __atomic_load_n(&arena_max, __ATOMIC_RELAXED) <= i)
+		return NULL;
+	for(j = 1; j <= i; j++)
+		if(&root == (heap = arena_get(j)))
+			return NULL;
+	return heap;
+}
+
+static int transfer_put(struct btff_heap* heap, int class, void* list, int count);
+
+static inline struct btff_heap* arena_of(void* ptr)
+{
+	int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	int i;
+	if(tlab_heap && (void*)tlab_heap < ptr && ptr < tlab_heap->end)
+		return tlab_heap;
+	for(i = 1; i < count; i++)
+		if((void*)arena[i] < ptr && ptr < arena[i]->end)
+			return arena[i];
+	return &root;
+}
+
+/* a shared heap whose lock holder died is checked and rebuilt before its
+   lock is made consistent. a tree that does not check out loses its magic:
+   the heap can no longer be opened, every entry fails with ENOTRECOVERABLE
+   and the version stays odd, so lockless readers take the lock too. the
+   mutex itself is kept consistent, an unrecoverable one blocks a later
+   pthread_mutex_lock in glibc rather than failing it. the stack is only
+   loaded from the heap once it checked out, the root level is read from
+   the root node. */
+static int heap_recover(struct btff_heap* heap, struct stack* stack)
+{
+	if(btff->recover(stack))
+		heap->magic = 0;
+	else
+	{
+		heap->available = stack[ROOT].available;
+		heap->list = stack[LIST].node;
+	}
+	pthread_mutex_consistent(&heap->mutex);
+	return MAGIC == heap->magic ? 0 : -1;
+}
+
+static inline void table_init(void)
+{
+	if(!btff)
+	{
+		handshake((void**)&btff, 0, 0);
+		btff->root = &root;
+		btff->spill = transfer_put;
+	}
+}
+
+/* the stack is loaded from a locked heap, after recover when the lock holder
+   died */
+static inline struct btff_heap* heap_load(struct btff_heap* heap, struct stack* stack, int error)
+{
+	VERSION_ENTER(heap);
+	stack[HEAP].node = heap;
+	if(EOWNERDEAD == error && heap_recover(heap, stack))
+		goto failed;
+	stack[ROOT].available = heap->available;
+	stack[ROOT].node = heap->node;
+	stack[LIST].node = heap->list;
+	return heap;
+failed:
+	pthread_mutex_unlock(&heap->mutex);
+	errno = ENOTRECOVERABLE;
+	return NULL;
+}
+
+/* a NULL heap takes the thread's arena, NULL comes back when a shared heap
+   could not be recovered */
+static inline struct btff_heap* heap_enter(struct btff_heap* heap, struct stack* stack)
+{
+	int error = 0;
+	table_init();
+	if(!heap)
+		heap = arena_lock();
+	else
+	{
+		if(EBUSY == (error = pthread_mutex_trylock(&heap->mutex)))
+		{
+			stats_contended(heap);
+			error = pthread_mutex_lock(&heap->mutex);
+		}
+		if(heap->shared && MAGIC != heap->magic)
+		{
+			if(EOWNERDEAD == error)
+				pthread_mutex_consistent(&heap->mutex);
+			pthread_mutex_unlock(&heap->mutex);
+			errno = ENOTRECOVERABLE;
+			return NULL;
+		}
+	}
+	return heap_load(heap, stack, error);
+}
+
+static inline void heap_leave(struct btff_heap* heap, struct stack* stack)
+{
+	if(heap->available != stack[ROOT].available)
+		heap->available = stack[ROOT].available;
+	if(heap->list != stack[LIST].node)
+		heap->list = stack[LIST].node;
+	VERSION_LEAVE(heap);
+	pthread_mutex_unlock(&heap->mutex);
+}
+
+/* thread local allocation buffers: with tlab set, a thread bump allocates
+   small blocks from a chunk of its own without a lock. chunks are taken from
+   a heap of their own, aligned to TLAB_SIZE, so a block finds its chunk by
+   masking, and a block carries its size in the word before it. live counts
+   down from TLAB_BIAS as blocks are freed; retiring the chunk takes the bias
+   off and adds the blocks handed out, the chunk goes back at zero. the owner
+   reuses a chunk in place once everything in it is freed. */
+
+#define TLAB_SIZE (64 * 1024)
+#define TLAB_BIAS (1L << 30)
+#define TLAB_HEADER ((sizeof(struct tlab) + ALIGNMENT - 1) & ~(unsigned long)(ALIGNMENT - 1))
+
+struct tlab
+{
+	void* top;
+	void* end;
+	long live;
+	long count;
+	void* seen;
+	struct tlab* next;
+	struct tlab** prev;
+};
+
+static struct tlab* tlab_list;
+static pthread_mutex_t tlab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tlab_key;
+static unsigned long tlab_size;
+static __thread struct tlab* tlab_own __attribute__((tls_model("initial-exec")));
+
+static void tlab_release(struct tlab* tlab)
+{
+	struct stack stack[STACK];
+	struct btff_heap* heap = heap_enter(tlab_heap, stack);
+	btff->free(stack, tlab);
+	heap_leave(heap, stack);
+}
+
+/* the tail from top on goes back to the tree, the chunk shrinks in place */
+static void tlab_shrink(struct tlab* tlab, void* top)
+{
+	struct stack stack[STACK];
+	struct btff_heap* heap;
+	size_t old_size;
+	if(top == tlab->end)
+		return;
+	heap = heap_enter(tlab_heap, stack);
+	btff->realloc(stack, tlab, &old_size, top - (void*)tlab);
+	heap_leave(heap, stack);
+}
+
+/* takes the tail for the caller, a trim may have taken it first */
+static void* tlab_claim(struct tlab* tlab)
+{
+	void* top = __atomic_load_n(&tlab->top, __ATOMIC_RELAXED);
+	while(top != tlab->end && !__atomic_compare_exchange_n(&tlab->top, &top, tlab->end, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		;
+	return top;
+}
+
+static void tlab_retire(struct tlab* tlab)
+{
+	void* top = tlab_claim(tlab);
+	pthread_mutex_lock(&tlab_mutex);
+	if((*tlab->prev = tlab->next))
+		tlab->next->prev = tlab->prev;
+	pthread_mutex_unlock(&tlab_mutex);
+	tlab_shrink(tlab, top);
+	if(!__atomic_add_fetch(&tlab->live, tlab->count - TLAB_BIAS, __ATOMIC_ACQ_REL))
+		tlab_release(tlab);
+}
+
+static void tlab_exit(void* value)
+{
+	if(tlab_own)
+		tlab_retire(tlab_own);
+	tlab_own = NULL;
+}
+
+static void* tlab_refill(size_t size)
+{
+	struct stack stack[STACK];
+	struct btff_heap* heap;
+	struct tlab* tlab;
+	unsigned long chunk = tlab_size;
+	void* ptr;
+	if(chunk < TLAB_HEADER + ALIGNMENT + size)
+		return NULL;
+	if(tlab_own)
+		tlab_retire(tlab_own);
+	tlab_own = NULL;
+	pthread_mutex_lock(&tlab_mutex);
+	if(!tlab_heap)
+	{
+		if(pthread_key_create(&tlab_key, tlab_exit) || !(heap = btff_heap_create(0)))
+		{
+			tlab_size = 0;
+			pthread_mutex_unlock(&tlab_mutex);
+			return NULL;
+		}
+		__atomic_store_n(&tlab_heap, heap, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&tlab_mutex);
+	heap = heap_enter(tlab_heap, stack);
+	tlab = btff->memalign(stack, TLAB_SIZE, chunk);
+	heap_leave(heap, stack);
+	if(!tlab)
+		return NULL;
+	ptr = (void*)tlab + TLAB_HEADER;
+	tlab->top = ptr + ALIGNMENT + size;
+	tlab->end = (void*)tlab + chunk;
+	tlab->live = TLAB_BIAS;
+	tlab->count = 1;
+	tlab->seen = NULL;
+	pthread_mutex_lock(&tlab_mutex);
+	if((tlab->next = tlab_list))
+		tlab->next->prev = &tlab->next;
+	tlab->prev = &tlab_list;
+	tlab_list = tlab;
+	pthread_mutex_unlock(&tlab_mutex);
+	pthread_setspecific(tlab_key, tlab);
+	tlab_own = tlab;
+	*(unsigned long*)ptr = size;
+	return ptr + ALIGNMENT;
+}
+
+static inline void* tlab_malloc(size_t size)
+{
+	struct tlab* tlab = tlab_own;
+	void* top;
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+	if(tlab_size / 16 < size)
+		return NULL;
+	if(tlab && (top = __atomic_load_n(&tlab->top, __ATOMIC_RELAXED)) + ALIGNMENT + size <= tlab->end
+		&& __atomic_compare_exchange_n(&tlab->top, &top, top + ALIGNMENT + size, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		tlab->count++;
+		*(unsigned long*)top = size;
+		return top + ALIGNMENT;
+	}
+	return tlab_refill(size);
+}
+
+#define tlab_of(ptr) ((struct tlab*)((unsigned long)(ptr) & ~(unsigned long)(TLAB_SIZE - 1)))
+#define tlab_block_size(ptr) (((unsigned long*)(ptr))[-1])
+
+static void tlab_free(void* ptr)
+{
+	struct tlab* tlab = tlab_of(ptr);
+	void* top;
+	long live;
+	if(tlab == tlab_own)
+	{
+		/* the last block handed out takes the top back */
+		top = ptr + tlab_block_size(ptr);
+		if(__atomic_compare_exchange_n(&tlab->top, &top, ptr - ALIGNMENT, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			tlab->count--;
+			return;
+		}
+		live = __atomic_sub_fetch(&tlab->live, 1, __ATOMIC_ACQ_REL);
+		top = __atomic_load_n(&tlab->top, __ATOMIC_ACQUIRE);
+		if(TLAB_BIAS - live == tlab->count && top != tlab->end
+			&& __atomic_compare_exchange_n(&tlab->top, &top, (void*)tlab + TLAB_HEADER, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			tlab->count = 0;
+			__atomic_store_n(&tlab->live, TLAB_BIAS, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	if(!__atomic_sub_fetch(&tlab->live, 1, __ATOMIC_ACQ_REL))
+		tlab_release(tlab);
+}
+
+/* hands back the tails of the chunks in use, of every one or only of those
+   that did not move since the last call */
+static void tlab_trim(int idle)
+{
+	struct tlab* tlab;
+	void* top;
+	pthread_mutex_lock(&tlab_mutex);
+	for(tlab = tlab_list; tlab; tlab = tlab->next)
+	{
+		top = __atomic_load_n(&tlab->top, __ATOMIC_RELAXED);
+		if(idle && top != tlab->seen)
+			tlab->seen = top;
+		else
+		if(top != tlab->end && __atomic_compare_exchange_n(&tlab->top, &top, tlab->end, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			tlab_shrink(tlab, top);
+	}
+	pthread_mutex_unlock(&tlab_mutex);
+}
+
+/* the transfer cache sits between the arenas and the threads. a quick list
+   that overflows hands the blocks it would free into the tree to the cache
+   as one batch, and a thread short of a size takes a whole batch and keeps
+   the rest for its next calls. the blocks stay allocated in the tree of
+   their arena and go back to it by address when freed. batches left unused
+   for a purge tick, and those kept by threads gone idle, go back to their
+   trees. */
+
+#define TRANSFER_SLOTS 16
+
+struct transfer
+{
+	pthread_mutex_t mutex;
+	int count;
+	int low;
+	void* batch[TRANSFER_SLOTS];
+	int size[TRANSFER_SLOTS];
+};
+
+struct tcache
+{
+	void* list[QUICK_SIZE];
+	unsigned long stamp;
+	unsigned long seen;
+	struct tcache* next;
+	struct tcache** prev;
+};
+
+static struct transfer transfer[QUICK_SIZE] = { [0 ... QUICK_SIZE - 1] = { PTHREAD_MUTEX_INITIALIZER } };
+static int transfer_slots = TRANSFER_SLOTS;
+static struct tcache* tcache_list;
+static pthread_mutex_t tcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static int tcache_keyed;
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+/* the bytes held in the slots, kept as batches come and go for the stats page */
+static unsigned long transfer_bytes;
+#define transfer_count(class, count) __atomic_fetch_add(&transfer_bytes, (long)(count) * ((class) + 1) * ALIGNMENT, __ATOMIC_RELAXED)
+
+/* the spill hook, called under the arena lock: batches of the process heap
+   only, and only while there is room */
+static int transfer_put(struct btff_heap* heap, int class, void* list, int count)
+{
+	struct transfer* slot = &transfer[class];
+	int arenas = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	int taken = 0;
+	int i;
+	for(i = 0; i < arenas && heap != arena[i]; i++)
+		;
+	if(i == arenas)
+		return 0;
+	pthread_mutex_lock(&slot->mutex);
+	if(slot->count < transfer_slots)
+	{
+		slot->batch[slot->count] = list;
+		slot->size[slot->count++] = count;
+		transfer_count(class, count);
+		taken = 1;
+	}
+	pthread_mutex_unlock(&slot->mutex);
+	return taken;
+}
+
+static void* transfer_get(int class)
+{
+	struct transfer* slot = &transfer[class];
+	void* list = NULL;
+	if(!__atomic_load_n(&slot->count, __ATOMIC_RELAXED))
+		return NULL;
+	pthread_mutex_lock(&slot->mutex);
+	if(slot->count)
+	{
+		list = slot->batch[--slot->count];
+		transfer_count(class, -slot->size[slot->count]);
+		if(slot->count < slot->low)
+			slot->low = slot->count;
+	}
+	pthread_mutex_unlock(&slot->mutex);
+	return list;
+}
+
+/* a batch back to the tree of its arena, past the quick lists */
+static void transfer_free(void* list)
+{
+	struct stack stack[STACK];
+	struct btff_heap* heap;
+	if(!list)
+		return;
+	heap = heap_enter(arena_of(list), stack);
+	btff->batch_free(stack, list);
+	heap_leave(heap, stack);
+}
+
+/* what a thread kept goes back to the cache, or to the tree once it is full */
+static void transfer_return(int class, void* list)
+{
+	struct transfer* slot = &transfer[class];
+	void* block;
+	int count;
+	for(count = 0, block = list; block; block = *(void**)block)
+		count++;
+	if(!count)
+		return;
+	pthread_mutex_lock(&slot->mutex);
+	if(slot->count < transfer_slots)
+	{
+		slot->batch[slot->count] = list;
+		slot->size[slot->count++] = count;
+		transfer_count(class, count);
+		list = NULL;
+	}
+	pthread_mutex_unlock(&slot->mutex);
+	transfer_free(list);
+}
+
+static void tcache_exit(void* value)
+{
+	int i;
+	pthread_mutex_lock(&tcache_mutex);
+	if((*tcache.prev = tcache.next))
+		tcache.next->prev = tcache.prev;
+	tcache.prev = NULL;
+	pthread_mutex_unlock(&tcache_mutex);
+	for(i = 0; i < QUICK_SIZE; i++)
+		transfer_return(i, __atomic_exchange_n(&tcache.list[i], NULL, __ATOMIC_ACQUIRE));
+}
+
+static void tcache_link(void)
+{
+	pthread_mutex_lock(&tcache_mutex);
+	if(!tcache_keyed && !pthread_key_create(&tcache_key, tcache_exit))
+		tcache_keyed = 1;
+	if(tcache_keyed)
+	{
+		if((tcache.next = tcache_list))
+			tcache.next->prev = &tcache.next;
+		tcache.prev = &tcache_list;
+		tcache_list = &tcache;
+	}
+	pthread_mutex_unlock(&tcache_mutex);
+	if(tcache.prev)
+		pthread_setspecific(tcache_key, &tcache);
+}
+
+/* the owner swaps a list out while it takes a block, a thief only swaps */
+static inline void* tcache_pop(size_t size)
+{
+	int class = (int)((size + ALIGNMENT - 1) / ALIGNMENT) - 1;
+	void* list;
+	if(!(list = __atomic_load_n(&tcache.list[class], __ATOMIC_RELAXED) ? __atomic_exchange_n(&tcache.list[class], NULL, __ATOMIC_ACQUIRE) : NULL))
+	{
+		if(!(list = transfer_get(class)))
+			return NULL;
+		if(!tcache.prev)
+			tcache_link();
+		if(!tcache.prev)
+		{
+			transfer_return(class, *(void**)list);
+			return list;
+		}
+	}
+	tcache.stamp++;
+	__atomic_store_n(&tcache.list[class], *(void**)list, __ATOMIC_RELEASE);
+	return list;
+}
+
+/* hands back the lists of threads that took no batch since the last call,
+   every one without idle, and the batches the cache did not need */
+static void transfer_trim(int idle)
+{
+	struct transfer* slot;
+	struct tcache* cache;
+	unsigned long stamp;
+	void* list[TRANSFER_SLOTS];
+	int count;
+	int i, j;
+	pthread_mutex_lock(&tcache_mutex);
+	for(cache = tcache_list; cache; cache = cache->next)
+	{
+		stamp = __atomic_load_n(&cache->stamp, __ATOMIC_RELAXED);
+		if(idle && stamp != cache->seen)
+			cache->seen = stamp;
+		else
+			for(i = 0; i < QUICK_SIZE; i++)
+				transfer_free(__atomic_exchange_n(&cache->list[i], NULL, __ATOMIC_ACQUIRE));
+	}
+	pthread_mutex_unlock(&tcache_mutex);
+	for(i = 0; i < QUICK_SIZE; i++)
+	{
+		slot = &transfer[i];
+		pthread_mutex_lock(&slot->mutex);
+		count = idle ? slot->low : slot->count;
+		for(j = 0; j < count; j++)
+		{
+			list[j] = slot->batch[j];
+			transfer_count(i, -slot->size[j]);
+		}
+		for(j = count; j < slot->count; j++)
+		{
+			slot->batch[j - count] = slot->batch[j];
+			slot->size[j - count] = slot->size[j];
+		}
+		slot->low = slot->count -= count;
+		pthread_mutex_unlock(&slot->mutex);
+		for(j = 0; j < count; j++)
+			transfer_free(list[j]);
+	}
+}
+
+static void* heap_malloc(struct btff_heap* heap, size_t size)
+{
+	struct stack stack[STACK];
+	void* ptr;
+	if(!heap && size <= QUICK_MAX && (ptr = tcache_pop(size)))
+	{
+		stats_fast(malloc);
+		return ptr;
+	}
+	if(!heap && tlab_size && (ptr = tlab_malloc(size)))
+	{
+		stats_fast(malloc);
+		return ptr;
+	}
+	if(!(heap = heap_enter(heap, stack)))
+		return NULL;
+	stats_count(heap, malloc);
+	ptr = btff->malloc(stack, size);
+	heap_leave(heap, stack);
+	return ptr;
+}
+
+static void heap_free(struct btff_heap* heap, void* ptr)
+{
+	struct stack stack[STACK];
+	if(heap == tlab_heap)
+	{
+		stats_fast(free);
+		tlab_free(ptr);
+		return;
+	}
+	if(!(heap = heap_enter(heap, stack)))
+		return;
+	stats_count(heap, free);
+	btff->free(stack, ptr);
+	heap_leave(heap, stack);
+}
+
+static void heap_free_sized(struct btff_heap* heap, void* ptr, size_t size)
+{
+	struct stack stack[STACK];
+	if(heap == tlab_heap)
+	{
+		stats_fast(free);
+		tlab_free(ptr);
+		return;
+	}
+	if(!(heap = heap_enter(heap, stack)))
+		return;
+	stats_count(heap, free);
+	btff->free_sized(stack, ptr, size);
+	heap_leave(heap, stack);
+}
+
+static void* heap_realloc(struct btff_heap* heap, void* ptr, size_t size)
+{
+	struct stack stack[STACK];
+	void* new;
+	if(heap && heap == tlab_heap)
+	{
+		/* a block does not grow inside its chunk, it moves to a new one */
+		stats_fast(realloc);
+		if(size && size <= tlab_block_size(ptr))
+			return ptr;
+		if((new = size ? heap_malloc(NULL, size) : NULL))
+			memcpy(new, ptr, tlab_block_size(ptr));
+		if(new || !size)
+			tlab_free(ptr);
+		return new;
+	}
+	if(!(heap = heap_enter(heap, stack)))
+		return NULL;
+	stats_count(heap, realloc);
+	if(ptr)
+	{
+		if(0 < size)
+		{
+			size_t old_size;
+			ptr = btff->realloc(stack, ptr, &old_size, size);
+		}
+		else
+		{
+			btff->free(stack, ptr);
+			ptr = NULL;
+		}
+	}
+	else
+	if(0 < size)
+		ptr = btff->malloc(stack, size);
+	heap_leave(heap, stack);
+	return ptr;
+}
+
+/* a lookup only reads the tree: it goes without the lock while the version
+   holds still, and takes the lock after STALE_RETRY misses */
+static size_t heap_usable_size(struct btff_heap* heap, void* ptr)
+{
+	struct stack stack[STACK];
+	unsigned long version;
+	size_t size;
+	int retry;
+	if(!btff)
+		return 0;
+	if(heap == tlab_heap)
+		return tlab_block_size(ptr);
+	for(retry = 0; retry < STALE_RETRY; retry++)
+		if(!((version = __atomic_load_n(&heap->version, __ATOMIC_ACQUIRE)) & 1) && STALE != (size = btff->usable_size(heap, ptr, version)))
+			return size;
+	if(!(heap = heap_enter(heap, stack)))
+		return 0;
+	size = btff->usable_size(heap, ptr, heap->version);
+	heap_leave(heap, stack);
+	return size;
+}
+
+static int heap_memalign(struct btff_heap* heap, void **memptr, size_t alignment, size_t size)
+{
+	struct stack stack[STACK];
+	if(alignment < sizeof(void*) || (alignment & (alignment - 1)))
+		return EINVAL;
+	if(0 == size)
+	{
+		*memptr = NULL;
+		return 0;
+	}
+	if(!(heap = heap_enter(heap, stack)))
+		return errno;
+	stats_count(heap, malloc);
+	*memptr = btff->memalign(stack, alignment, size);
+	heap_leave(heap, stack);
+	return *memptr ? 0 : ENOMEM;
+}
+
+/* resize without moving: size + extra is tried first, then size when the
+   block has less, and the usable size comes back either way. a block does
+   not grow inside its chunk. */
+static size_t heap_resize(struct btff_heap* heap, void* ptr, size_t size, size_t extra)
+{
+	struct stack stack[STACK];
+	size_t old_size = 0;
+	if(heap == tlab_heap)
+		return tlab_block_size(ptr);
+	if(extra > (size_t)-1 - size)
+		extra = (size_t)-1 - size;
+	if(!(heap = heap_enter(heap, stack)))
+		return 0;
+	stats_count(heap, realloc);
+	if(!btff->resize(stack, ptr, &old_size, size + extra, 0) && extra && old_size < size)
+		btff->resize(stack, ptr, &old_size, size, 0);
+	heap_leave(heap, stack);
+	return old_size;
+}
+
+/* sampling profile of the process heap: on average once every prof_rate bytes
+   the call site is recorded with the block. the gaps are drawn exponentially,
+   so the samples are poisson and pprof scales them back up. the tables are
+   mapped, not allocated, and a dump only writes, so it may run in a signal
+   handler. each thread counts down on its own, drawing its first gap on its
+   first sample. with profiling off a malloc only tests prof_rate and a free
+   only tests prof_live. */
+
+#define PROF_DEPTH 32
+#define PROF_BUCKETS 4096
+#define PROF_SAMPLES 65536
+#define PROF_HASH 16384
+#define PROF_INDEX(p) ((int)(((unsigned long)(p) / ALIGNMENT) % PROF_HASH))
+
+struct prof_bucket
+{
+	struct prof_bucket* next;
+	unsigned long hash;
+	int depth;
+	long inuse_count;
+	long inuse_bytes;
+	long alloc_count;
+	long alloc_bytes;
+	void* frames[PROF_DEPTH];
+};
+
+struct prof_sample
+{
+	struct prof_sample* next;
+	void* ptr;
+	size_t size;
+	struct prof_bucket* bucket;
+};
+
+struct prof
+{
+	pthread_mutex_t mutex;
+	struct prof_bucket* buckets[PROF_HASH];
+	struct prof_sample* samples[PROF_HASH];
+	struct prof_sample* free;
+	int bucket_count;
+	int dumps;
+	struct prof_bucket bucket[PROF_BUCKETS];
+	struct prof_sample sample[PROF_SAMPLES];
+};
+
+static struct prof* prof;
+static __thread long prof_left __attribute__((tls_model("initial-exec")));
+static __thread unsigned long prof_seed __attribute__((tls_model("initial-exec")));
+static long prof_live;
+static long prof_rate;
+static unsigned long prof_salt = 88172645463325252UL;
+static char prof_path[256];
+
+static long prof_next(void)
+{
+	double x;
+	double t;
+	int e;
+	if(!prof_seed)
+		prof_seed = (prof_salt ^ (unsigned long)&prof_seed * 2654435761UL) | 1;
+	prof_seed ^= prof_seed << 13;
+	prof_seed ^= prof_seed >> 7;
+	prof_seed ^= prof_seed << 17;
+	x = (double)((prof_seed >> 11) + 1) / (double)(1UL << 53);
+	for(e = 0; x < 0.5; e++)
+		x *= 2;
+	/* ln x = 2 atanh t, t in [-1/3, 0] */
+	t = (x - 1) / (x + 1);
+	return 1 + (long)((e * 0.6931471805599453 - 2 * t * (1 + t * t / 3 + t * t * t * t / 5)) * prof_rate);
+}
+
+static void __attribute__((noinline)) prof_record(void* ptr, size_t size)
+{
+	void* frames[PROF_DEPTH + 1];
+	struct prof_bucket* bucket;
+	struct prof_sample* sample;
+	unsigned long hash;
+	int depth;
+	int i;
+	if(!prof_rate)
+		return;
+	/* a thread's first gap is drawn now and this block counted against it */
+	if(!prof_seed && 0 <= (prof_left = prof_next() - (long)size))
+		return;
+	prof_left = prof_next();
+	if(!ptr || pthread_mutex_trylock(&prof->mutex))
+		return;
+	if(!(sample = prof->free))
+		goto RETURN;
+	/* the first frame is prof_record */
+	depth = backtrace(frames, PROF_DEPTH + 1) - 1;
+	for(hash = 0, i = 1; i <= depth; i++)
+		hash = (hash + (unsigned long)frames[i]) * 0x9e3779b97f4a7c15UL;
+	for(bucket = prof->buckets[hash % PROF_HASH]; bucket; bucket = bucket->next)
+		if(bucket->hash == hash && bucket->depth == depth && !memcmp(bucket->frames, frames + 1, depth * sizeof(void*)))
+			break;
+	if(!bucket)
+	{
+		if(PROF_BUCKETS <= prof->bucket_count)
+			goto RETURN;
+		bucket = &prof->bucket[prof->bucket_count++];
+		bucket->hash = hash;
+		bucket->depth = depth;
+		memcpy(bucket->frames, frames + 1, depth * sizeof(void*));
+		bucket->next = prof->buckets[hash % PROF_HASH];
+		prof->buckets[hash % PROF_HASH] = bucket;
+	}
+	bucket->inuse_count++;
+	bucket->inuse_bytes += size;
+	bucket->alloc_count++;
+	bucket->alloc_bytes += size;
+	prof->free = sample->next;
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->bucket = bucket;
+	sample->next = prof->samples[PROF_INDEX(ptr)];
+	prof->samples[PROF_INDEX(ptr)] = sample;
+	__atomic_store_n(&prof_live, prof_live + 1, __ATOMIC_RELAXED);
+RETURN:
+	pthread_mutex_unlock(&prof->mutex);
+}
+
+static void prof_forget(void* ptr)
+{
+	struct prof_sample** link;
+	struct prof_sample* sample;
+	pthread_mutex_lock(&prof->mutex);
+	for(link = &prof->samples[PROF_INDEX(ptr)]; (sample = *link); link = &sample->next)
+		if(sample->ptr == ptr)
+		{
+			*link = sample->next;
+			sample->bucket->inuse_count--;
+			sample->bucket->inuse_bytes -= sample->size;
+			sample->next = prof->free;
+			prof->free = sample;
+			__atomic_store_n(&prof_live, prof_live - 1, __ATOMIC_RELAXED);
+			break;
+		}
+	pthread_mutex_unlock(&prof->mutex);
+}
+
+static inline void prof_malloc(void* ptr, size_t size)
+{
+	if(__atomic_load_n(&prof_rate, __ATOMIC_RELAXED) && (prof_left -= (long)size) < 0)
+		prof_record(ptr, size);
+}
+
+/* a sample is dropped before its block is freed, the address may be reused */
+static inline void prof_free(void* ptr)
+{
+	if(__atomic_load_n(&prof_live, __ATOMIC_RELAXED))
+		prof_forget(ptr);
+}
+
+struct prof_out
+{
+	int fd;
+	int n;
+	char buffer[4096];
+};
+
+static void prof_flush(struct prof_out* out)
+{
+	if(0 < out->n)
+		write(out->fd, out->buffer, out->n);
+	out->n = 0;
+}
+
+static void prof_put(struct prof_out* out, const char* s)
+{
+	for( ; *s; s++)
+	{
+		if(out->n == sizeof(out->buffer))
+			prof_flush(out);
+		out->buffer[out->n++] = *s;
+	}
+}
+
+static void prof_number(struct prof_out* out, unsigned long n, int base)
+{
+	char digits[24];
+	int i;
+	i = sizeof(digits) - 1;
+	digits[i] = '\0';
+	do
+		digits[--i] = "0123456789abcdef"[n % base];
+	while(n /= base);
+	if(16 == base)
+		prof_put(out, "0x");
+	prof_put(out, digits + i);
+}
+
+static void prof_counts(struct prof_out* out, long inuse_count, long inuse_bytes, long alloc_count, long alloc_bytes)
+{
+	prof_number(out, inuse_count, 10);
+	prof_put(out, ": ");
+	prof_number(out, inuse_bytes, 10);
+	prof_put(out, " [");
+	prof_number(out, alloc_count, 10);
+	prof_put(out, ": ");
+	prof_number(out, alloc_bytes, 10);
+	prof_put(out, "] @");
+}
+
+/* the legacy heap profile text that pprof reads: totals, a line per call
+   site, then the mappings to symbolize against */
+static int prof_dump(const char* path, int wait)
+{
+	struct prof_out out;
+	struct prof_bucket* bucket;
+	long inuse_count, inuse_bytes, alloc_count, alloc_bytes;
+	int fd;
+	int i;
+	int n;
+	if(!prof)
+		return EINVAL;
+	if(wait)
+		pthread_mutex_lock(&prof->mutex);
+	else
+	if(pthread_mutex_trylock(&prof->mutex))
+		return EBUSY;
+	out.fd = -1;
+	out.n = 0;
+	if(!path)
+	{
+		prof_put(&out, prof_path);
+		prof_put(&out, ".");
+		prof_number(&out, getpid(), 10);
+		prof_put(&out, ".");
+		prof_number(&out, prof->dumps++, 10);
+		prof_put(&out, ".heap");
+		out.buffer[out.n] = '\0';
+		path = out.buffer;
+	}
+	if(-1 == (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)))
+	{
+		pthread_mutex_unlock(&prof->mutex);
+		return errno;
+	}
+	out.fd = fd;
+	out.n = 0;
+	inuse_count = inuse_bytes = alloc_count = alloc_bytes = 0;
+	for(i = 0; i < prof->bucket_count; i++)
+	{
+		bucket = &prof->bucket[i];
+		inuse_count += bucket->inuse_count;
+		inuse_bytes += bucket->inuse_bytes;
+		alloc_count += bucket->alloc_count;
+		alloc_bytes += bucket->alloc_bytes;
+	}
+	prof_put(&out, "heap profile: ");
+	prof_counts(&out, inuse_count, inuse_bytes, alloc_count, alloc_bytes);
+	prof_put(&out, " heap_v2/");
+	prof_number(&out, prof_rate, 10);
+	prof_put(&out, "\n");
+	for(i = 0; i < prof->bucket_count; i++)
+	{
+		bucket = &prof->bucket[i];
+		prof_counts(&out, bucket->inuse_count, bucket->inuse_bytes, bucket->alloc_count, bucket->alloc_bytes);
+		for(n = 0; n < bucket->depth; n++)
+		{
+			prof_put(&out, " ");
+			prof_number(&out, (unsigned long)bucket->frames[n], 16);
+		}
+		prof_put(&out, "\n");
+	}
+	prof_put(&out, "\nMAPPED_LIBRARIES:\n");
+	prof_flush(&out);
+	if(-1 != (fd = open("/proc/self/maps", O_RDONLY)))
+	{
+		while(0 < (n = read(fd, out.buffer, sizeof(out.buffer))))
+			write(out.fd, out.buffer, n);
+		close(fd);
+	}
+	close(out.fd);
+	pthread_mutex_unlock(&prof->mutex);
+	return 0;
+}
+
+static void prof_signal(int signal)
+{
+	int error = errno;
+	prof_dump(NULL, 0);
+	errno = error;
+}
+
+/* not atexit, btff.so is linked without the libc stub that provides it */
+static void __attribute__((destructor)) prof_exit(void)
+{
+	if(prof_rate)
+		prof_dump(NULL, 1);
+}
+
+int btff_profile_start(size_t rate, const char* path, int signal)
+{
+	struct sigaction action;
+	void* frames[1];
+	int i;
+	if(!rate || (path && sizeof(prof_path) <= strlen(path)))
+		return EINVAL;
+	if(!prof)
+	{
+		if(MAP_FAILED == (prof = mmap(NULL, sizeof(struct prof), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)))
+		{
+			prof = NULL;
+			return ENOMEM;
+		}
+		pthread_mutex_init(&prof->mutex, NULL);
+		for(i = PROF_SAMPLES - 1; i >= 0; i--)
+		{
+			prof->sample[i].next = prof->free;
+			prof->free = &prof->sample[i];
+		}
+		/* backtrace loads its unwinder on first use, with malloc */
+		backtrace(frames, 1);
+	}
+	strcpy(prof_path, path ? path : "btff");
+	if(signal)
+	{
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = prof_signal;
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		if(-1 == sigaction(signal, &action, NULL))
+			return errno;
+	}
+	prof_salt ^= (unsigned long)getpid() * 2654435761UL ^ (unsigned long)time(NULL);
+	__atomic_store_n(&prof_rate, rate, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int btff_profile_dump(const char* path)
+{
+	return prof_dump(path, 1);
+}
+
+/* live samples are still dropped as their blocks are freed */
+void btff_profile_stop(void)
+{
+	__atomic_store_n(&prof_rate, 0, __ATOMIC_RELEASE);
+}
+
+/* the prefixed api, for linking btff in directly */
+
+void* btff_malloc(size_t size)
+{
+	void* ptr;
+	if(0 >= size)
+		return NULL;
+	ptr = heap_malloc(NULL, size);
+	prof_malloc(ptr, size);
+	return ptr;
+}
+
+void btff_free(void* ptr)
+{
+	if(!ptr)
+		return;
+	prof_free(ptr);
+	heap_free(arena_of(ptr), ptr);
+}
+
+void btff_free_sized(void* ptr, size_t size)
+{
+	if(!ptr)
+		return;
+	prof_free(ptr);
+	heap_free_sized(arena_of(ptr), ptr, size);
+}
+
+void* btff_realloc(void* ptr, size_t size)
+{
+	if(!ptr && size <= 0)
+		return NULL;
+	if(ptr)
+		prof_free(ptr);
+	ptr = heap_realloc(ptr ? arena_of(ptr) : NULL, ptr, size);
+	prof_malloc(ptr, size);
+	return ptr;
+}
+
+void* btff_calloc(size_t nmemb, size_t size)
+{
+	void* ptr;
+	if(size && nmemb > (size_t)-1 / size)
+		return NULL;
+	if((ptr = btff_malloc(nmemb * size)))
+		return memset(ptr, 0, nmemb * size);
+	return NULL;
+}
+
+int btff_posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+	int error;
+	if(!(error = heap_memalign(NULL, memptr, alignment, size)))
+		prof_malloc(*memptr, size);
+	return error;
+}
+
+void* btff_memalign(size_t alignment, size_t size)
+{
+	void* ptr;
+	if(btff_posix_memalign(&ptr, alignment, size))
+		return NULL;
+	return ptr;
+}
+
+size_t btff_usable_size(void* ptr)
+{
+	if(!ptr)
+		return 0;
+	return heap_usable_size(arena_of(ptr), ptr);
+}
+
+#ifndef BTFF_STATIC
 void *malloc(size_t size)
 {
+	void* ptr;
 	if(0 >= size)
 		return NULL;
-	else
-	{
-		struct stack stack[STACK];
-		void* ptr;
-		pthread_mutex_lock(&root.mutex);
-		if(!btff)
-		{
-			posix_memalign((void**)&btff, 0, 0);
-			btff->root = &root;
-		}
-		stack[ROOT].available = root.available;
-		stack[ROOT].node = root.node;
-		stack[LIST].node = root.list;
-		ptr = btff->malloc(stack, size);
-		if(root.available != stack[ROOT].available)
-			root.available = stack[ROOT].available;
-		if(root.list != stack[LIST].node)
-			root.list = stack[LIST].node;
-		pthread_mutex_unlock(&root.mutex);
-		return ptr;
-	}
+	ptr = heap_malloc(NULL, size);
+	prof_malloc(ptr, size);
+	return ptr;
 }
 
 void free(void *ptr)
 {
 	if(!ptr || ptr == btff)
 		return;
+	prof_free(ptr);
+	heap_free(arena_of(ptr), ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if(!ptr && size <= 0)
+		return NULL;
+	if(ptr == btff)
+		return NULL;
+	if(ptr)
+		prof_free(ptr);
+	ptr = heap_realloc(ptr ? arena_of(ptr) : NULL, ptr, size);
+	prof_malloc(ptr, size);
+	return ptr;
+}
+#endif
+
+/* a persistent heap is a file mapped at a fixed base address.
+   its root sits at the base, so the tree and the application data
+   reached from root->data are valid again once the file is re-attached.
+   a shared heap is mapped at the same base in every process and is
+   guarded by a process shared, robust mutex in its root. */
+
+static unsigned long heap_header_size(void)
+{
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	return (sizeof(struct btff_heap) + page - 1) & ~(page - 1);
+}
+
+/* a file heap found with its version odd was left by a process that died
+   inside an operation. it is recovered as a shared heap is after
+   EOWNERDEAD before it is handed out, and not opened when it does not
+   check out. */
+static int heap_reopen(struct btff_heap* heap)
+{
+	struct stack stack[STACK];
+	table_init();
+	pthread_mutex_lock(&heap->mutex);
+	if(!heap_load(heap, stack, EOWNERDEAD))
+		return -1;
+	heap_leave(heap, stack);
+	return 0;
+}
+
+static struct btff_heap* heap_map(int fd, void* base, size_t size, int shared, int create)
+{
+	struct btff_heap* heap;
+	struct btff_heap header;
+	struct stat st;
+	unsigned long page;
+	unsigned long header_size;
+	page = sysconf(_SC_PAGESIZE);
+	header_size = heap_header_size();
+	if(-1 == fstat(fd, &st))
+		return NULL;
+	if(create < 0)
+		create = !st.st_size;
+	if(create)
+	{
+		size = (size + page - 1) & ~(page - 1);
+		if(((unsigned long)base & (page - 1)) || size <= header_size)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+		if(-1 == ftruncate(fd, size))
+			return NULL;
+	}
+	else
+	{
+		if(!st.st_size || sizeof(header) != pread(fd, &header, sizeof(header), 0) || MAGIC != header.magic)
+		{
+			errno = shared ? EAGAIN : EINVAL;
+			return NULL;
+		}
+		base = header.begin - header_size;
+		size = header.end - base;
+		if(st.st_size != size)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	if(MAP_FAILED == (heap = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)))
+		return NULL;
+	if(heap != base)
+	{
+		munmap(heap, size);
+		errno = EADDRINUSE;
+		return NULL;
+	}
+	if(create)
+	{
+		if(shared)
+		{
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&heap->mutex, &attr);
+			pthread_mutexattr_destroy(&attr);
+		}
+		else
+			pthread_mutex_init(&heap->mutex, NULL);
+		heap->shared = shared;
+		heap->cache = QUICK_DEPTH;
+		heap->provider = PROVIDER_MAP;
+		heap->begin = heap->top = base + header_size;
+		heap->end = heap->pool = base + size;
+		heap->magic = MAGIC;
+	}
 	else
+	if(!heap->shared)
 	{
-		struct stack stack[STACK];
-		pthread_mutex_lock(&root.mutex);
-		if(!btff)
+		pthread_mutex_init(&heap->mutex, NULL);
+		if((heap->version & 1) && heap_reopen(heap))
 		{
-			posix_memalign((void**)&btff, 0, 0);
-			btff->root = &root;
+			munmap(heap, size);
+			errno = ENOTRECOVERABLE;
+			return NULL;
 		}
-		stack[ROOT].available = root.available;
-		stack[ROOT].node = root.node;
-		stack[LIST].node = root.list;
-		btff->free(stack, ptr);
-		if(root.available != stack[ROOT].available)
-			root.available = stack[ROOT].available;
-		if(root.list != stack[LIST].node)
-			root.list = stack[LIST].node;
-		pthread_mutex_unlock(&root.mutex);
 	}
+	return heap;
 }
 
-void *realloc(void *ptr, size_t size)
+struct btff_heap* btff_heap_open(const char* path, void* base, size_t size)
 {
-	if(!ptr && size <= 0)
+	struct btff_heap* heap;
+	int fd;
+	if(-1 == (fd = open(path, O_RDWR | O_CREAT, 0600)))
+		return NULL;
+	heap = heap_map(fd, base, size, 0, -1);
+	close(fd);
+	return heap;
+}
+
+struct btff_heap* btff_heap_share(const char* name, void* base, size_t size)
+{
+	struct btff_heap* heap;
+	int fd;
+	int retry;
+	if(-1 != (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)))
+	{
+		if(!(heap = heap_map(fd, base, size, 1, 1)))
+			shm_unlink(name);
+		close(fd);
+		return heap;
+	}
+	if(EEXIST != errno || -1 == (fd = shm_open(name, O_RDWR, 0600)))
+		return NULL;
+	for(retry = 0; !(heap = heap_map(fd, base, size, 1, 0)) && EAGAIN == errno && retry < 1000; retry++)
+		usleep(1000);
+	close(fd);
+	return heap;
+}
+
+struct btff_heap* btff_heap_share_fd(int fd, void* base, size_t size)
+{
+	return heap_map(fd, base, size, 1, -1);
+}
+
+void btff_heap_close(struct btff_heap* heap)
+{
+	void* base = heap;
+	size_t size = heap->end - base;
+	msync(base, size, MS_SYNC);
+	munmap(base, size);
+}
+
+/* a private heap of its own: the range is only reserved here and
+   committed by the core as the heap grows into it */
+
+struct btff_heap* btff_heap_create(size_t size)
+{
+	struct btff_heap* heap;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long header_size = heap_header_size();
+	if(!size)
+		size = RESERVE_SIZE;
+	size = (size + page - 1) & ~(page - 1);
+	if(size <= header_size)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(MAP_FAILED == (heap = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)))
+		return NULL;
+	if(-1 == mprotect(heap, header_size, PROT_READ | PROT_WRITE))
+	{
+		munmap(heap, size);
+		return NULL;
+	}
+	pthread_mutex_init(&heap->mutex, NULL);
+	heap->cache = QUICK_DEPTH;
+	heap->provider = PROVIDER_RESERVE;
+	heap->begin = heap->top = heap->commit = (void*)heap + header_size;
+	heap->end = heap->pool = (void*)heap + size;
+	heap->magic = MAGIC;
+	return heap;
+}
+
+void btff_heap_destroy(struct btff_heap* heap)
+{
+	munmap(heap, heap->end - (void*)heap);
+}
+
+/* a NULL heap is the process heap */
+
+void* btff_heap_malloc(struct btff_heap* heap, size_t size)
+{
+	if(0 >= size)
 		return NULL;
 	else
-	if(ptr == btff)
+		return heap_malloc(heap, size);
+}
+
+void btff_heap_free(struct btff_heap* heap, void* ptr)
+{
+	if(ptr)
+		heap_free(heap ? heap : arena_of(ptr), ptr);
+}
+
+void* btff_heap_realloc(struct btff_heap* heap, void* ptr, size_t size)
+{
+	if(!ptr && size <= 0)
 		return NULL;
 	else
+		return heap_realloc(heap || !ptr ? heap : arena_of(ptr), ptr, size);
+}
+
+void* btff_heap_memalign(struct btff_heap* heap, size_t alignment, size_t size)
+{
+	void* ptr;
+	if(heap_memalign(heap, &ptr, alignment, size))
+		return NULL;
+	return ptr;
+}
+
+size_t btff_heap_usable_size(struct btff_heap* heap, void* ptr)
+{
+	if(!ptr)
+		return 0;
+	return heap_usable_size(heap ? heap : arena_of(ptr), ptr);
+}
+
+/* levels from the root node down to the leaves, 0 while the tree is empty */
+int btff_heap_depth(struct btff_heap* heap)
+{
+	struct stack stack[STACK];
+	int depth;
+	if(!(heap = heap_enter(heap ? heap : &root, stack)))
+		return -1;
+	depth = heap->node ? LEAF - LEVEL(heap->node) + 1 : 0;
+	heap_leave(heap, stack);
+	return depth;
+}
+
+/* at most steps merges or splits ahead per operation, the rest is left
+   for the operations that follow, 0 is unbounded. a NULL heap sets every
+   arena of the process heap. returns the previous setting. */
+int btff_heap_steps(struct btff_heap* heap, int steps)
+{
+	struct stack stack[STACK];
+	int previous;
+	int i;
+	if(steps < 0)
+		return -1;
+	if(heap)
+	{
+		if(!(heap = heap_enter(heap, stack)))
+			return -1;
+		previous = heap->steps;
+		heap->steps = steps;
+		heap_leave(heap, stack);
+		return previous;
+	}
+	pthread_mutex_lock(&arena_mutex);
+	previous = root.steps;
+	for(i = 0; i < arena_count; i++)
+		btff_heap_steps(arena[i], steps);
+	pthread_mutex_unlock(&arena_mutex);
+	return previous;
+}
+
+/* packs the tree afresh: leaves filled to fill percent, REBUILD_FILL when 0,
+   nodes in one block breadth first. the lock is held throughout, so it is
+   for idle time. a NULL heap rebuilds every arena. */
+int btff_heap_rebuild(struct btff_heap* heap, int fill)
+{
+	struct stack stack[STACK];
+	int error;
+	int i;
+	if(fill < 0 || 100 < fill)
+		return EINVAL;
+	if(!fill)
+		fill = REBUILD_FILL;
+	if(!heap)
+	{
+		for(i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
+			if((error = btff_heap_rebuild(arena[i], fill)))
+				return error;
+		return 0;
+	}
+	if(!(heap = heap_enter(heap, stack)))
+		return errno;
+	error = btff->rebuild(stack, fill);
+	heap_leave(heap, stack);
+	return error;
+}
+
+/* purging hands the pages of idle free runs back, a batch per lock hold.
+   the background thread advances the epoch of the process heap every
+   tick, a run left free for PURGE_STEPS ticks is purged. */
+
+static pthread_t purge_thread;
+static volatile int purge_running;
+static struct timespec purge_tick;
+
+static size_t heap_purge(struct btff_heap* heap, unsigned long age, int tick)
+{
+	struct stack stack[STACK];
+	unsigned long purged;
+	if(!(heap = heap_enter(heap, stack)))
+		return 0;
+	if(tick)
+		heap->epoch++;
+	purged = heap->purged;
+	while(!btff->purge(stack, age, PURGE_BATCH))
+	{
+		heap_leave(heap, stack);
+		if(!(heap = heap_enter(heap, stack)))
+			return 0;
+	}
+	purged = heap->purged - purged;
+	heap_leave(heap, stack);
+	return purged;
+}
+
+size_t btff_heap_purge(struct btff_heap* heap, unsigned long age)
+{
+	size_t purged = 0;
+	int i;
+	if(heap)
+		return heap_purge(heap, age, 0);
+	transfer_trim(0);
+	if(tlab_heap)
+	{
+		tlab_trim(0);
+		purged += heap_purge(tlab_heap, age, 0);
+	}
+	for(i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
+		purged += heap_purge(arena[i], age, 0);
+	return purged;
+}
+
+static void* purge_main(void* arg)
+{
+	int i;
+	while(purge_running)
+	{
+		nanosleep(&purge_tick, NULL);
+		transfer_trim(1);
+		if(tlab_heap)
+		{
+			tlab_trim(1);
+			heap_purge(tlab_heap, PURGE_STEPS, 1);
+		}
+		for(i = 0; i < __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE); i++)
+			heap_purge(arena[i], PURGE_STEPS, 1);
+	}
+	return NULL;
+}
+
+int btff_purge_start(unsigned long decay)
+{
+	if(purge_running || decay < PURGE_STEPS)
+		return EINVAL;
+	decay /= PURGE_STEPS;
+	purge_tick.tv_sec = decay / 1000;
+	purge_tick.tv_nsec = decay % 1000 * 1000000;
+	purge_running = 1;
+	if((errno = pthread_create(&purge_thread, NULL, purge_main, NULL)))
+	{
+		purge_running = 0;
+		return errno;
+	}
+	return 0;
+}
+
+void btff_purge_stop(void)
+{
+	if(!purge_running)
+		return;
+	purge_running = 0;
+	pthread_join(purge_thread, NULL);
+}
+
+/* the stats page is shared memory under /dev/shm for btff-top to map. every
+   interval the thread copies the totals each arena keeps as it goes, without
+   its lock, so a figure may be an op behind the others. */
+
+static pthread_t stats_thread;
+static volatile int stats_running;
+static struct timespec stats_tick;
+static char stats_name[32];
+static void* stats_retired;
+
+static void stats_refresh(void)
+{
+	struct stats_heap* slot;
+	struct btff_heap* heap;
+	unsigned long quick;
+	void* node;
+	int count;
+	int i, j;
+	count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+	for(i = 0; i < count; i++)
+	{
+		heap = arena[i];
+		slot = &stats->heap[i];
+		slot->size = __atomic_load_n(&heap->heap_size, __ATOMIC_RELAXED);
+		slot->available = __atomic_load_n(&heap->free_size, __ATOMIC_RELAXED);
+		slot->runs = __atomic_load_n(&heap->free_runs, __ATOMIC_RELAXED);
+		for(quick = 0, j = 0; j < QUICK_SIZE; j++)
+			quick += __atomic_load_n(&heap->quick_size[j], __ATOMIC_RELAXED) * (j + 1) * ALIGNMENT;
+		slot->quick = quick;
+		slot->purged = __atomic_load_n(&heap->purged, __ATOMIC_RELAXED);
+		node = __atomic_load_n(&heap->node, __ATOMIC_RELAXED);
+		slot->depth = node ? LEAF - LEVEL(node) + 1 : 0;
+	}
+	stats->heaps = count;
+	if((heap = __atomic_load_n(&tlab_heap, __ATOMIC_ACQUIRE)))
+		stats->tlab = __atomic_load_n(&heap->heap_size, __ATOMIC_RELAXED) - __atomic_load_n(&heap->free_size, __ATOMIC_RELAXED);
+	stats->transfer = __atomic_load_n(&transfer_bytes, __ATOMIC_RELAXED);
+	stats->updated++;
+}
+
+static void* stats_main(void* arg)
+{
+	while(stats_running)
+	{
+		stats_refresh();
+		nanosleep(&stats_tick, NULL);
+	}
+	return NULL;
+}
+
+/* interval in milliseconds */
+int btff_stats_start(unsigned long interval)
+{
+	char digits[16];
+	char* name;
+	pid_t pid;
+	int fd;
+	int i;
+	if(stats || !interval)
+		return EINVAL;
+	strcpy(stats_name, "/btff.");
+	for(pid = getpid(), i = 0; pid; pid /= 10)
+		digits[i++] = '0' + pid % 10;
+	for(name = stats_name + strlen(stats_name); i; )
+		*name++ = digits[--i];
+	*name = 0;
+	if(-1 == (fd = shm_open(stats_name, O_RDWR | O_CREAT | O_TRUNC, 0644)))
+		return errno;
+	if(-1 == ftruncate(fd, sizeof(struct stats)) || MAP_FAILED == (stats = mmap(stats_retired, sizeof(struct stats), PROT_READ | PROT_WRITE, MAP_SHARED | (stats_retired ? MAP_FIXED : 0), fd, 0)))
+	{
+		i = errno;
+		stats = NULL;
+		close(fd);
+		shm_unlink(stats_name);
+		return i;
+	}
+	close(fd);
+	stats->pid = getpid();
+	stats->interval = interval;
+	stats_tick.tv_sec = interval / 1000;
+	stats_tick.tv_nsec = interval % 1000 * 1000000;
+	pthread_mutex_lock(&arena_mutex);
+	for(i = 0; i < arena_count; i++)
+		arena[i]->stats = &stats->heap[i];
+	pthread_mutex_unlock(&arena_mutex);
+	stats->magic = STATS_MAGIC;
+	stats_running = 1;
+	if((errno = pthread_create(&stats_thread, NULL, stats_main, NULL)))
 	{
-		struct stack stack[STACK];
-		pthread_mutex_lock(&root.mutex);
-		if(!btff)
+		stats_running = 0;
+		btff_stats_stop();
+		return errno;
+	}
+	return 0;
+}
+
+void btff_stats_stop(void)
+{
+	int i;
+	if(!stats)
+		return;
+	if(stats_running)
+	{
+		stats_running = 0;
+		pthread_join(stats_thread, NULL);
+	}
+	pthread_mutex_lock(&arena_mutex);
+	for(i = 0; i < arena_count; i++)
+		arena[i]->stats = NULL;
+	pthread_mutex_unlock(&arena_mutex);
+	shm_unlink(stats_name);
+	/* an op without a lock may still be counting into the page: it stays
+	   mapped, and the next start maps over it */
+	stats_retired = stats;
+	__atomic_store_n(&stats, NULL, __ATOMIC_RELAXED);
+}
+
+/* the page is not left behind in /dev/shm */
+static void __attribute__((destructor)) stats_exit(void)
+{
+	if(stats)
+		shm_unlink(stats_name);
+}
+
+/* tunables, set by mallopt or BTFF_OPTIONS. the trim and mmap thresholds,
+   the quick list depth and the placement policy are kept per heap, set on
+   every arena at once and inherited from the root by arenas made later. */
+
+int btff_mallopt(int param, int value)
+{
+	struct stack stack[STACK];
+	struct btff_heap* heap;
+	int i;
+	if(value < 0)
+		return 0;
+	switch(param)
+	{
+	case M_ARENA_MAX:
+		__atomic_store_n(&arena_max, value && value < ARENA_SIZE ? value : ARENA_SIZE, __ATOMIC_RELAXED);
+		return 1;
+	case M_BTFF_DECAY:
+		btff_purge_stop();
+		return !value || !btff_purge_start(value);
+	case M_BTFF_STEPS:
+		return -1 != btff_heap_steps(NULL, value);
+	case M_BTFF_TLAB:
+		if(value && (value < 1024 || TLAB_SIZE < value))
+			return 0;
+		tlab_size = value & ~(ALIGNMENT - 1);
+		return 1;
+	case M_BTFF_TRANSFER:
+		if(TRANSFER_SLOTS < value)
+			return 0;
+		transfer_slots = value;
+		return 1;
+	case M_BTFF_POLICY:
+		if(BTFF_PLACE_FIRST < value)
+			return 0;
+	case M_TRIM_THRESHOLD:
+	case M_MMAP_THRESHOLD:
+	case M_BTFF_CACHE:
+		break;
+	default:
+		return 0;
+	}
+	pthread_mutex_lock(&arena_mutex);
+	for(i = 0; i < arena_count; i++)
+	{
+		heap = heap_enter(arena[i], stack);
+		switch(param)
 		{
-			posix_memalign((void**)&btff, 0, 0);
-			btff->root = &root;
+		case M_TRIM_THRESHOLD:
+			heap->trim = value;
+			break;
+		case M_MMAP_THRESHOLD:
+			heap->release = value;
+			break;
+		case M_BTFF_CACHE:
+			heap->cache = value;
+			break;
+		case M_BTFF_POLICY:
+			heap->policy = value;
+			break;
 		}
-		stack[ROOT].available = root.available;
-		stack[ROOT].node = root.node;
-		stack[LIST].node = root.list;
-		if(ptr)
+		heap_leave(heap, stack);
+	}
+	pthread_mutex_unlock(&arena_mutex);
+	return 1;
+}
+
+static const struct option
+{
+	const char* name;
+	int param;
+} option[] = {
+	{ "trim", M_TRIM_THRESHOLD },
+	{ "mmap", M_MMAP_THRESHOLD },
+	{ "cache", M_BTFF_CACHE },
+	{ "arenas", M_ARENA_MAX },
+	{ "decay", M_BTFF_DECAY },
+	{ "policy", M_BTFF_POLICY },
+	{ "steps", M_BTFF_STEPS },
+	{ "tlab", M_BTFF_TLAB },
+	{ "transfer", M_BTFF_TRANSFER },
+};
+
+#define OPTION_SIZE ((int)(sizeof(option) / sizeof(*option)))
+
+/* name=value pairs apart by commas, sizes in bytes may end in k, m or g:
+   trim=1m,mmap=256k,cache=8,arenas=4,decay=10000,policy=first,steps=2,
+   tlab=64k,transfer=4.
+   read in place without allocating. returns the number of pairs refused. */
+int btff_options(const char* options)
+{
+	unsigned long size;
+	char* end;
+	int refused = 0;
+	int length;
+	int value;
+	int i;
+	while(*options)
+	{
+		length = strcspn(options, "=,");
+		for(i = 0; i < OPTION_SIZE; i++)
+			if(!strncmp(options, option[i].name, length) && !option[i].name[length])
+				break;
+		options += length;
+		value = -1;
+		if('=' == *options)
 		{
-			if(0 < size)
+			options++;
+			length = strcspn(options, ",");
+			if(i < OPTION_SIZE && M_BTFF_POLICY == option[i].param)
 			{
-				size_t old_size;
-				void* new_ptr;
-				new_ptr = btff->realloc(stack, ptr, &old_size, size);
-				if(new_ptr != ptr)
-				{
-					btff->memmove(new_ptr, ptr, old_size);
-					ptr = new_ptr;
-				}
+				if(5 == length && !strncmp(options, "index", length))
+					value = BTFF_PLACE_INDEX;
+				else
+				if(5 == length && !strncmp(options, "first", length))
+					value = BTFF_PLACE_FIRST;
 			}
 			else
 			{
-				btff->free(stack, ptr);
-				ptr = NULL;
+				size = strtoul(options, &end, 0);
+				switch(*end)
+				{
+				case 'g':
+				case 'G':
+					size <<= 10;
+				case 'm':
+				case 'M':
+					size <<= 10;
+				case 'k':
+				case 'K':
+					size <<= 10;
+					end++;
+				}
+				if(end != options && end == options + length)
+					value = size < INT_MAX ? size : INT_MAX;
 			}
+			options += length;
 		}
-		else
-		if(0 < size)
-			ptr = btff->malloc(stack, size);
-		if(root.available != stack[ROOT].available)
-			root.available = stack[ROOT].available;
-		if(root.list != stack[LIST].node)
-			root.list = stack[LIST].node;
-		pthread_mutex_unlock(&root.mutex);
-		return ptr;
+		if(i == OPTION_SIZE || value < 0 || !btff_mallopt(option[i].param, value))
+			refused++;
+		if(',' == *options)
+			options++;
 	}
+	return refused;
 }
 
+/* a region is one run taken from the tree and bump allocated.
+   runs chained when it fills up are released by reset, the rest by destroy. */
+
+struct btff_region* btff_region_create(size_t size)
+{
+	struct btff_region* region;
+	while(size & (ALIGNMENT - 1))
+		size++;
+	if(!(region = btff_malloc(sizeof(struct btff_region) + size)))
+		return NULL;
+	region->next = NULL;
+	region->top = region + 1;
+	region->end = region->top + size;
+	region->size = size;
+	return region;
+}
+
+void* btff_region_alloc(struct btff_region* region, size_t size)
+{
+	struct btff_region* chunk;
+	void* ptr;
+	if(0 >= size)
+		return NULL;
+	while(size & (ALIGNMENT - 1))
+		size++;
+	chunk = region->next ? region->next : region;
+	if(chunk->end - chunk->top < size)
+	{
+		size_t chunk_size = size < region->size ? region->size : size;
+		if(!(chunk = btff_malloc(sizeof(struct btff_region) + chunk_size)))
+			return NULL;
+		chunk->top = chunk + 1;
+		chunk->end = chunk->top + chunk_size;
+		chunk->size = chunk_size;
+		chunk->next = region->next;
+		region->next = chunk;
+	}
+	ptr = chunk->top;
+	chunk->top += size;
+	return ptr;
+}
+
+void btff_region_reset(struct btff_region* region)
+{
+	struct btff_region* chunk;
+	while((chunk = region->next))
+	{
+		region->next = chunk->next;
+		btff_free(chunk);
+	}
+	region->top = region + 1;
+}
+
+void btff_region_destroy(struct btff_region* region)
+{
+	if(!region)
+		return;
+	btff_region_reset(region);
+	btff_free(region);
+}
+
+/* the extended api: flags pick the alignment, zeroing and where a block
+   comes from. an arena by index goes past the thread cache and the buffers;
+   a region block comes from the thread's bound region, is freed with it and
+   is not resized. */
+
+#define flags_alignment(flags) ((flags) & 0x3f ? (size_t)1 << ((flags) & 0x3f) : 0)
+#define flags_arena(flags) (((flags) >> 12) - 1)
+
+static __thread struct btff_region* region_bound;
+
+struct btff_region* btff_region_bind(struct btff_region* region)
+{
+	struct btff_region* old = region_bound;
+	region_bound = region;
+	return old;
+}
+
+static void* region_mallocx(size_t size, int flags)
+{
+	size_t alignment = flags_alignment(flags);
+	unsigned long address;
+	void* ptr;
+	if(alignment < ALIGNMENT)
+		alignment = ALIGNMENT;
+	if(!region_bound || !(ptr = btff_region_alloc(region_bound, size + alignment - ALIGNMENT)))
+		return NULL;
+	address = ((unsigned long)ptr + alignment - 1) & ~(unsigned long)(alignment - 1);
+	if(flags & BTFF_ZERO)
+		memset((void*)address, 0, size);
+	return (void*)address;
+}
+
+void* btff_mallocx(size_t size, int flags)
+{
+	struct btff_heap* heap = NULL;
+	size_t alignment = flags_alignment(flags);
+	void* ptr;
+	if(0 >= size)
+		return NULL;
+	if(flags & BTFF_REGION)
+		return region_mallocx(size, flags);
+	if(0 <= flags_arena(flags) && !(heap = arena_select(flags_arena(flags))))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!heap && flags & BTFF_TCACHE_NONE)
+		heap = arena[arena_current()];
+	if(ALIGNMENT < alignment)
+	{
+		if(heap_memalign(heap, &ptr, alignment, size))
+			return NULL;
+	}
+	else
+	if(!(ptr = heap_malloc(heap, size)))
+		return NULL;
+	prof_malloc(ptr, size);
+	if(flags & BTFF_ZERO)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+size_t btff_xallocx(void* ptr, size_t size, size_t extra, int flags)
+{
+	size_t old_size;
+	if(!ptr || flags & BTFF_REGION)
+		return 0;
+	old_size = btff_usable_size(ptr);
+	if(0 >= size)
+		return old_size;
+	/* a block that kept its size keeps its sample */
+	if((size = heap_resize(arena_of(ptr), ptr, size, extra)) != old_size)
+	{
+		prof_free(ptr);
+		prof_malloc(ptr, size);
+	}
+	if(flags & BTFF_ZERO && old_size < size)
+		memset(ptr + old_size, 0, size - old_size);
+	return size;
+}
+
+/* in place when the block fits where it is and keeps the alignment asked for,
+   moved otherwise unless BTFF_INPLACE */
+void* btff_rallocx(void* ptr, size_t size, int flags)
+{
+	size_t alignment = flags_alignment(flags);
+	size_t old_size;
+	void* new;
+	if(!ptr)
+		return btff_mallocx(size, flags);
+	if(0 >= size || flags & BTFF_REGION)
+		return NULL;
+	if(!(alignment && (unsigned long)ptr & (alignment - 1)) && size <= btff_xallocx(ptr, size, 0, flags))
+		return ptr;
+	if(flags & BTFF_INPLACE)
+		return NULL;
+	old_size = btff_usable_size(ptr);
+	if(!(new = btff_mallocx(size, flags & ~BTFF_ZERO)))
+		return NULL;
+	memcpy(new, ptr, old_size < size ? old_size : size);
+	if(flags & BTFF_ZERO && old_size < size)
+		memset(new + old_size, 0, size - old_size);
+	btff_free(ptr);
+	return new;
+}
+
+size_t btff_sallocx(void* ptr, int flags)
+{
+	if(flags & BTFF_REGION)
+		return 0;
+	return btff_usable_size(ptr);
+}
+
+void btff_dallocx(void* ptr, int flags)
+{
+	if(!(flags & BTFF_REGION))
+		btff_free(ptr);
+}
+
+#ifndef BTFF_STATIC
 static pid_t (*pfork)(void);
 
 pid_t fork(void)
 {
 	pid_t pid;
-    pthread_mutex_lock(&root.mutex);
-    pid = pfork();
-    pthread_mutex_unlock(&root.mutex);
+	int i;
+	int count;
+	if(prof)
+		pthread_mutex_lock(&prof->mutex);
+	pthread_mutex_lock(&tlab_mutex);
+	pthread_mutex_lock(&tcache_mutex);
+	pthread_mutex_lock(&arena_mutex);
+	count = arena_count;
+	for(i = 0; i < count; i++)
+		pthread_mutex_lock(&arena[i]->mutex);
+	for(i = 0; i < QUICK_SIZE; i++)
+		pthread_mutex_lock(&transfer[i].mutex);
+	if(tlab_heap)
+		pthread_mutex_lock(&tlab_heap->mutex);
+	pid = pfork();
+	/* the child has no stats thread, and the page is the parent's */
+	if(!pid && stats)
+	{
+		for(i = 0; i < count; i++)
+			arena[i]->stats = NULL;
+		stats_running = 0;
+		stats = NULL;
+	}
+	if(tlab_heap)
+		pthread_mutex_unlock(&tlab_heap->mutex);
+	for(i = QUICK_SIZE - 1; i >= 0; i--)
+		pthread_mutex_unlock(&transfer[i].mutex);
+	for(i = count - 1; i >= 0; i--)
+		pthread_mutex_unlock(&arena[i]->mutex);
+	pthread_mutex_unlock(&arena_mutex);
+	pthread_mutex_unlock(&tcache_mutex);
+	pthread_mutex_unlock(&tlab_mutex);
+	if(prof)
+		pthread_mutex_unlock(&prof->mutex);
 	return pid;
 }
 
+/* BTFF_OPTIONS sets the tunables, see btff_options.
+   BTFF_PROFILE=bytes samples the heap from the start, dumping to
+   BTFF_PROFILE_PATH.pid.n.heap at exit and on BTFF_PROFILE_SIGNAL.
+   BTFF_STATS=milliseconds publishes the stats page at that interval. */
 void _init(void)
 {
+	char* options;
+	char* rate;
+	char* signal;
+	char* interval;
     pfork = dlsym(RTLD_NEXT, "fork");
+	if((options = getenv("BTFF_OPTIONS")))
+		btff_options(options);
+	if((rate = getenv("BTFF_PROFILE")))
+		btff_profile_start(strtoul(rate, NULL, 0), getenv("BTFF_PROFILE_PATH"), (signal = getenv("BTFF_PROFILE_SIGNAL")) ? atoi(signal) : 0);
+	if((interval = getenv("BTFF_STATS")))
+		btff_stats_start(strtoul(interval, NULL, 0));
 }
+#endif
 
@@ -0,0 +1,191 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, operator new and delete */
+#include <cstddef>
+#include <new>
+#include "btff-internal.h"
+
+/* new goes to btff directly rather than through malloc, and sized delete hands
+   the size down so that small blocks skip the tree search. over-aligned new
+   is cut from a free run that holds it rather than grown from the heap. */
+
+static inline void* new_alloc(std::size_t size, std::size_t alignment) noexcept
+{
+	if(0 == size)
+		size = 1;
+	if(alignment <= ALIGNMENT)
+		return btff_malloc(size);
+	else
+		return btff_memalign(alignment, size);
+}
+
+static void* new_retry(std::size_t size, std::size_t alignment)
+{
+	std::new_handler handler;
+	void* ptr;
+	while(!(ptr = new_alloc(size, alignment)))
+	{
+		if(!(handler = std::get_new_handler()))
+			throw std::bad_alloc();
+		handler();
+	}
+	return ptr;
+}
+
+static inline void* new_throw(std::size_t size, std::size_t alignment)
+{
+	void* ptr;
+	if((ptr = new_alloc(size, alignment)))
+		return ptr;
+	return new_retry(size, alignment);
+}
+
+static inline void* new_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+	void* ptr;
+	if((ptr = new_alloc(size, alignment)))
+		return ptr;
+	try
+	{
+		return new_retry(size, alignment);
+	}
+	catch(...)
+	{
+		return NULL;
+	}
+}
+
+static inline void delete_sized(void* ptr, std::size_t size) noexcept
+{
+	if(ptr)
+		btff_free_sized(ptr, size ? size : 1);
+}
+
+void* operator new(std::size_t size)
+{
+	return new_throw(size, ALIGNMENT);
+}
+
+void* operator new[](std::size_t size)
+{
+	return new_throw(size, ALIGNMENT);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return new_nothrow(size, ALIGNMENT);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return new_nothrow(size, ALIGNMENT);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return new_throw(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return new_throw(size, (std::size_t)alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return new_nothrow(size, (std::size_t)alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return new_nothrow(size, (std::size_t)alignment);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+	delete_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+	delete_sized(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	btff_free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+	delete_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+	delete_sized(ptr, size);
+}
@@ -0,0 +1,294 @@
+/*------------------------------------------------------------------------------
+
+Copyright (c) 2014, Young H. Song song@youngho.net
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. All advertising materials mentioning features or use of this software
+   must display the following acknowledgement:
+   This product includes software developed by the Young H. Song.
+4. Neither the name of the Young H. Song nor the
+   names of its contributors may be used to endorse or promote products
+   derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY Young H. Song ''AS IS'' AND ANY
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL Young H. Song BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+------------------------------------------------------------------------------*/
+/* B Tree First Fit Memory Allocator, fragmentation workload
+
+   allocates through plain malloc and free, so the same binary measures the
+   system allocator or btff.so under LD_PRELOAD. sizes and lifetimes are drawn
+   from a profile, blocks die in order of a virtual clock, and every report
+   interval a csv line records live bytes, the span of the live blocks, the
+   program break, the resident set and the tree depth when btff is loaded. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <math.h>
+#include <sys/mman.h>
+
+struct block
+{
+	unsigned long death;
+	char* ptr;
+	size_t size;
+};
+
+/* blocks by time of death, a binary heap kept outside the measured malloc */
+static struct block* queue;
+static unsigned long queue_size;
+static unsigned long queue_capacity;
+
+static unsigned long seed = 88172645463325252UL;
+static double mean_life = 30;
+static double mean_size = 256;
+
+static double uniform(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return (double)((seed >> 11) + 1) / (double)(1UL << 53);
+}
+
+static double exponential(double mean)
+{
+	return -log(uniform()) * mean;
+}
+
+static void queue_push(unsigned long death, char* ptr, size_t size)
+{
+	unsigned long i;
+	if(queue_size == queue_capacity)
+	{
+		unsigned long capacity = queue_capacity ? queue_capacity * 2 : 1 << 16;
+		void* p = queue ? mremap(queue, queue_capacity * sizeof(*queue), capacity * sizeof(*queue), MREMAP_MAYMOVE)
+			: mmap(NULL, capacity * sizeof(*queue), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(MAP_FAILED == p)
+		{
+			perror("queue");
+			exit(EXIT_FAILURE);
+		}
+		queue = p;
+		queue_capacity = capacity;
+	}
+	for(i = queue_size++; i && queue[(i - 1) / 2].death > death; i = (i - 1) / 2)
+		queue[i] = queue[(i - 1) / 2];
+	queue[i].death = death;
+	queue[i].ptr = ptr;
+	queue[i].size = size;
+}
+
+static void queue_pop(void)
+{
+	struct block last = queue[--queue_size];
+	unsigned long i;
+	unsigned long child;
+	for(i = 0; (child = 2 * i + 1) < queue_size; i = child)
+	{
+		if(child + 1 < queue_size && queue[child + 1].death < queue[child].death)
+			child++;
+		if(last.death <= queue[child].death)
+			break;
+		queue[i] = queue[child];
+	}
+	queue[i] = last;
+}
+
+/* profiles: each draws the size and lifetime, in ms, of the next block at
+   virtual time now. a request of the server profile is a burst of blocks
+   that die together, some of it kept as long lived cache entries. */
+
+static void exponential_profile(unsigned long now, size_t* size, unsigned long* life)
+{
+	*size = 16 + exponential(mean_size);
+	*life = exponential(mean_life * 1000);
+}
+
+static void bimodal_profile(unsigned long now, size_t* size, unsigned long* life)
+{
+	if(uniform() < 0.9)
+	{
+		*size = 16 + uniform() * 112;
+		*life = exponential(mean_life * 1000 / 6);
+	}
+	else
+	{
+		*size = 4096 + uniform() * 61440;
+		*life = exponential(mean_life * 1000 * 20);
+	}
+}
+
+static void phase_profile(unsigned long now, size_t* size, unsigned long* life)
+{
+	static const double scale[] = { 0.25, 8, 1 };
+	*size = 16 + exponential(mean_size * scale[now / 1800000 % 3]);
+	if(uniform() < 0.05)
+		*life = exponential(7200000);
+	else
+		*life = exponential(mean_life * 1000 / 3);
+}
+
+static void server_profile(unsigned long now, size_t* size, unsigned long* life)
+{
+	static unsigned long request_left;
+	static unsigned long request_life;
+	if(!request_left)
+	{
+		request_left = 1 + exponential(20);
+		request_life = 1 + exponential(200);
+	}
+	request_left--;
+	if(uniform() < 0.05)
+	{
+		*size = 1024 + uniform() * 15360;
+		*life = exponential(1800000);
+	}
+	else
+	{
+		*size = 16 + exponential(mean_size);
+		*life = request_life;
+	}
+}
+
+static const struct
+{
+	const char* name;
+	void (*draw)(unsigned long now, size_t* size, unsigned long* life);
+}
+profiles[] =
+{
+	{ "exponential", exponential_profile },
+	{ "bimodal", bimodal_profile },
+	{ "phase", phase_profile },
+	{ "server", server_profile },
+};
+
+static unsigned long resident(void)
+{
+	unsigned long size = 0;
+	unsigned long pages = 0;
+	FILE* file;
+	if((file = fopen("/proc/self/statm", "r")))
+	{
+		if(2 != fscanf(file, "%lu %lu", &size, &pages))
+			pages = 0;
+		fclose(file);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-p exponential|bimodal|phase|server] [-t hours] [-r allocations per second]\n"
+		"	[-s mean size] [-l mean life in seconds] [-i report interval in seconds] [-x seed]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	void (*draw)(unsigned long now, size_t* size, unsigned long* life) = phase_profile;
+	int (*depth)(void* heap);
+	double hours = 4;
+	unsigned long rate = 200;
+	unsigned long interval = 60;
+	unsigned long now, end, report;
+	unsigned long live = 0, peak_live = 0, peak_resident = 0;
+	unsigned long rss = 0;
+	char* base = sbrk(0);
+	int option;
+	int i;
+	while(-1 != (option = getopt(argc, argv, "p:t:r:s:l:i:x:")))
+		switch(option)
+		{
+		case 'p':
+			for(i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++)
+				if(!strcmp(optarg, profiles[i].name))
+					break;
+			if(i == (int)(sizeof(profiles) / sizeof(profiles[0])))
+				usage(argv[0]);
+			draw = profiles[i].draw;
+			break;
+		case 't': hours = atof(optarg); break;
+		case 'r': rate = strtoul(optarg, NULL, 0); break;
+		case 's': mean_size = atof(optarg); break;
+		case 'l': mean_life = atof(optarg); break;
+		case 'i': interval = strtoul(optarg, NULL, 0); break;
+		case 'x': seed = strtoul(optarg, NULL, 0) | 1; break;
+		default: usage(argv[0]);
+		}
+	if(!rate || !interval)
+		usage(argv[0]);
+	depth = (int (*)(void*))dlsym(RTLD_DEFAULT, "btff_heap_depth");
+	printf("seconds,live,blocks,span,brk,rss,depth\n");
+	end = hours * 3600000;
+	for(now = 0, report = 0; now <= end; now++)
+	{
+		unsigned long n;
+		/* about rate allocations a second, spread over the milliseconds */
+		for(n = rate / 1000 + (uniform() * 1000 < rate % 1000); n; n--)
+		{
+			size_t size;
+			unsigned long life;
+			char* ptr;
+			draw(now, &size, &life);
+			if(!(ptr = malloc(size)))
+			{
+				fprintf(stderr, "out of memory at %lu s\n", now / 1000);
+				return EXIT_FAILURE;
+			}
+			memset(ptr, (int)now, size);
+			queue_push(now + life, ptr, size);
+			live += size;
+		}
+		while(queue_size && queue[0].death <= now)
+		{
+			live -= queue[0].size;
+			free(queue[0].ptr);
+			queue_pop();
+		}
+		if(peak_live < live)
+			peak_live = live;
+		if(now == report)
+		{
+			char* low = NULL;
+			char* high = NULL;
+			unsigned long j;
+			for(j = 0; j < queue_size; j++)
+			{
+				if(!low || queue[j].ptr < low)
+					low = queue[j].ptr;
+				if(!high || high < queue[j].ptr + queue[j].size)
+					high = queue[j].ptr + queue[j].size;
+			}
+			rss = resident();
+			if(peak_resident < rss)
+				peak_resident = rss;
+			printf("%lu,%lu,%lu,%lu,%lu,%lu,%d\n", now / 1000, live, queue_size, (unsigned long)(high - low),
+				(unsigned long)((char*)sbrk(0) - base), rss, depth ? depth(NULL) : -1);
+			fflush(stdout);
+			report += interval * 1000;
+		}
+	}
+	fprintf(stderr, "peak live %lu, peak rss %lu, final live %lu, final rss %lu, rss/live %.2f\n",
+		peak_live, peak_resident, live, rss, live ? (double)rss / live : 0.0);
+	return 0;
+}
@@ -0,0 +1,7 @@
+#!/bin/sh
+# usage: workload_btff.sh [profile] [hours]
+# runs the same workload on the system malloc and on btff.so, one csv each
+PROFILE=${1:-phase}
+HOURS=${2:-4}
+./workload -p $PROFILE -t $HOURS > glibc.$PROFILE.csv
+LD_PRELOAD=~/lib/btff.so ./workload -p $PROFILE -t $HOURS > btff.$PROFILE.csv